@@ -0,0 +1,356 @@
+#include "aot.hpp"
+#include "verifier.hpp"
+
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+namespace {
+
+std::string quote(const std::string& str) {
+	std::string res = "\"";
+	for(unsigned char c : str) {
+		if(c == '"' || c == '\\') {
+			res += '\\';
+			res += c;
+		} else if(c < 0x20 || c >= 0x7f) {
+			char buffer[5];
+			std::snprintf(buffer, sizeof(buffer), "\\%03o", c);
+			res += buffer;
+		} else {
+			res += c;
+		}
+	}
+	return res + "\"";
+}
+
+std::string slot(int32_t idx) {
+	return "fp[" + std::to_string(idx) + "]";
+}
+
+class Translator {
+public:
+	Translator(Chunk& chunk) : chunk(chunk), heights(computeStackHeights(chunk)),
+		globalCnt(0), methodCnt(0) {}
+	
+	std::string translate() {
+		std::stringstream functions;
+		for(uint32_t i = 0; i < chunk.functions.size(); i++) {
+			functions << "static Value proto_" << i << "(AotRuntime& rt, Function* closure, Value* fp) {\n";
+			translateFunction(functions, i);
+			functions << "}\n\n";
+		}
+		
+		res << "// Generated by somire aot\n";
+		res << "#include <string>\n";
+		res << "#include <cmath>\n\n";
+		res << "#include \"vm/aot_runtime.hpp\"\n\n";
+		for(uint32_t i = 0; i < chunk.functions.size(); i++) {
+			res << "static Value proto_" << i << "(AotRuntime& rt, Function* closure, Value* fp);\n";
+		}
+		res << "\n";
+		res << "static Value* globalCache[" << std::max(globalCnt, 1u) << "];\n";
+		res << "static CFunction* methodCache[" << std::max(methodCnt, 1u) << "];\n\n";
+		res << functions.str();
+		
+		res << "int main() {\n";
+		res << "\tint status;\n";
+		res << "\t{\n";
+		res << "\t\tAotRuntime rt({";
+		for(uint32_t i = 0; i < chunk.functions.size(); i++) {
+			res << (i == 0 ? "" : ", ") << "proto_" << i;
+		}
+		res << "});\n";
+		for(uint32_t i = 0; i < chunk.constants->vec.size(); i++) {
+			Value val = chunk.constants->vec[i];
+			String* str = val.get<String>();
+			res << "\t\trt.constants->vec.push_back(";
+			if(str) {
+				res << "Value(new String(std::string(" << quote(str->str) << ", " << str->str.size() << "))));\n";
+			} else {
+				res << literal(val) << ");\n";
+			}
+		}
+		res << "\t\tstatus = rt.run();\n";
+		res << "\t}\n";
+		res << "\tGC::collect();\n";
+		res << "\treturn status;\n";
+		res << "}\n";
+		return res.str();
+	}
+
+private:
+	Chunk& chunk;
+	std::vector<std::vector<int32_t>> heights;
+	std::stringstream res;
+	uint32_t globalCnt;
+	uint32_t methodCnt;
+	
+	// C++ expression for a constant which is not an object
+	std::string literal(Value val) {
+		if(val.isNil()) return "Value::nil()";
+		if(val.isBool()) return val.getBool() ? "Value(true)" : "Value(false)";
+		if(val.isInt()) return "Value((int32_t) " + std::to_string(val.getInt()) + ")";
+		if(std::isfinite(val.getReal())) {
+			char buffer[32];
+			std::snprintf(buffer, sizeof(buffer), "%a", val.getReal());
+			return "Value(" + std::string(buffer) + ")";
+		}
+		if(std::isinf(val.getReal()))
+			return val.getReal() > 0 ? "Value(HUGE_VAL)" : "Value(-HUGE_VAL)";
+		return "Value(NAN)";
+	}
+	
+	std::string constant(uint16_t idx) {
+		Value val = chunk.constants->vec[idx];
+		if(val.isObject()) return "rt.constants->vec[" + std::to_string(idx) + "]";
+		return literal(val);
+	}
+	
+	std::string stringConstant(uint16_t idx) {
+		return quote(chunk.constants->vec[idx].get<String>()->str);
+	}
+	
+	void translateFunction(std::stringstream& out, uint32_t funcIdx) {
+		std::vector<uint8_t>& code = chunk.functions[funcIdx]->code;
+		std::vector<int32_t>& funcHeights = heights[funcIdx];
+		
+		// Locals can only be captured by closures made in the same frame
+		bool capturesLocals;
+		std::vector<bool> isJumpTarget = findJumpTargets(code, &capturesLocals);
+		std::string closeLocals = capturesLocals ? "\trt.closeUpvalues(fp);\n" : "";
+		
+		out << "\trt.enter(fp, " << funcHeights[0] << ", " << chunk.functions[funcIdx]->maxStack << ");\n";
+		
+		auto it = code.begin();
+		while(it != code.end()) {
+			uint32_t pos = it - code.begin();
+			int32_t h = funcHeights[pos];
+			if(isJumpTarget[pos])
+				out << "L" << pos << ":\n";
+			Opcode op = (Opcode) readUI8(it);
+			auto operands = it;
+			it = code.begin() + pos;
+			skipInstruction(it);
+			uint32_t next = it - code.begin();
+			if(h == -1) continue; // unreachable
+			
+			std::string top = slot(h-1);
+			std::string second = slot(h-2);
+			auto binary = [&](std::string expr) {
+				out << "\t" << second << " = " << expr << ";\n";
+			};
+			
+			out << "\t// " << opcodeDesc(op) << "\n";
+			switch(op) {
+			case Opcode::IGNORE:
+			case Opcode::LET:
+				break;
+			case Opcode::CONSTANT:
+				out << "\t" << slot(h) << " = " << constant(readUI16(operands)) << ";\n";
+				break;
+			case Opcode::UNI_MINUS:
+				out << "\t" << top << " = " << top << ".negate();\n";
+				out << "\tGC::step();\n";
+				break;
+			case Opcode::BIN_PLUS:
+			case Opcode::ADD_REAL:
+				binary(second + ".plus(" + top + ")");
+				if(op == Opcode::BIN_PLUS) out << "\tGC::step();\n";
+				break;
+			case Opcode::BIN_MINUS:
+			case Opcode::SUB_REAL:
+				binary(second + ".minus(" + top + ")");
+				break;
+			case Opcode::MULTIPLY:
+			case Opcode::MUL_REAL:
+				binary(second + ".multiply(" + top + ")");
+				break;
+			case Opcode::DIVIDE:
+			case Opcode::DIV_REAL:
+				binary(second + ".divide(" + top + ")");
+				break;
+			case Opcode::MODULO:
+			case Opcode::MOD_REAL:
+				binary(second + ".modulo(" + top + ")");
+				break;
+			case Opcode::POWER:
+				binary(second + ".power(" + top + ")");
+				break;
+			case Opcode::NOT:
+				out << "\t" << top << " = AotRuntime::logicalNot(" << top << ");\n";
+				break;
+			case Opcode::AND:
+				binary("AotRuntime::logicalAnd(" + second + ", " + top + ")");
+				break;
+			case Opcode::OR:
+				binary("AotRuntime::logicalOr(" + second + ", " + top + ")");
+				break;
+			case Opcode::EQUALS:
+				binary("Value(" + second + ".equals(" + top + "))");
+				break;
+			case Opcode::LESS:
+			case Opcode::LESS_REAL:
+				binary("Value(" + second + ".less(" + top + "))");
+				break;
+			case Opcode::LESS_OR_EQ:
+			case Opcode::LESS_OR_EQ_REAL:
+				binary("Value(" + second + ".less_or_eq(" + top + "))");
+				break;
+			case Opcode::ADD_INT:
+				binary("AotRuntime::addInt(" + second + ", " + top + ")");
+				break;
+			case Opcode::SUB_INT:
+				binary("AotRuntime::subInt(" + second + ", " + top + ")");
+				break;
+			case Opcode::MUL_INT:
+				binary("AotRuntime::mulInt(" + second + ", " + top + ")");
+				break;
+			case Opcode::MOD_INT:
+				binary("AotRuntime::modInt(" + second + ", " + top + ")");
+				break;
+			case Opcode::EQUALS_INT:
+				binary("Value(AotRuntime::equalsInt(" + second + ", " + top + "))");
+				break;
+			case Opcode::LESS_INT:
+				binary("Value(AotRuntime::lessInt(" + second + ", " + top + "))");
+				break;
+			case Opcode::LESS_OR_EQ_INT:
+				binary("Value(AotRuntime::lessOrEqInt(" + second + ", " + top + "))");
+				break;
+			case Opcode::INDEX:
+			case Opcode::INDEX_LIST_INT:
+				binary("AotRuntime::index(" + second + ", " + top + ")");
+				break;
+			case Opcode::POP: {
+				uint16_t amount = readUI16(operands);
+				if(capturesLocals)
+					out << "\trt.closeUpvalues(fp + " << (h - amount) << ");\n";
+				break;
+			} case Opcode::SET_LOCAL: {
+				int16_t idx = readI16(operands);
+				if(idx >= 0)
+					out << "\t" << slot(idx) << " = " << top << ";\n";
+				else
+					out << "\tclosure->upvalues[" << (-idx-1) << "]->set(" << top << ");\n";
+				break;
+			} case Opcode::LOCAL: {
+				int16_t idx = readI16(operands);
+				if(idx >= 0)
+					out << "\t" << slot(h) << " = " << slot(idx) << ";\n";
+				else
+					out << "\t" << slot(h) << " = closure->upvalues[" << (-idx-1) << "]->resolve();\n";
+				break;
+			} case Opcode::GLOBAL:
+				out << "\t" << slot(h) << " = rt.getGlobal(globalCache[" << globalCnt++ << "], "
+					<< stringConstant(readUI16(operands)) << ");\n";
+				break;
+			case Opcode::JUMP_IF_NOT: {
+				int16_t relJump = readI16(operands);
+				out << "\tif(!AotRuntime::condition(" << top << ")) goto L" << (next + relJump) << ";\n";
+				break;
+			} case Opcode::JUMP:
+				out << "\tgoto L" << (next + readI16(operands)) << ";\n";
+				break;
+			case Opcode::CALL: {
+				uint16_t argCnt = readUI16(operands);
+				int32_t args = h - 1 - argCnt;
+				out << "\t" << slot(args) << " = rt.call(" << top << ", fp + " << args << ", " << argCnt << ");\n";
+				out << "\tGC::step();\n";
+				break;
+			} case Opcode::TAIL_CALL: {
+				uint16_t argCnt = readUI16(operands);
+				int32_t args = h - 1 - argCnt;
+				out << "\treturn rt.tailCall(fp, " << top << ", fp + " << args << ", " << argCnt << ");\n";
+				break;
+			} case Opcode::RETURN:
+				out << closeLocals;
+				out << "\treturn " << top << ";\n";
+				break;
+			case Opcode::MAKE_FUNC: {
+				uint16_t protoIdx = readUI16(operands);
+				uint16_t argCnt = readUI16(operands);
+				uint16_t upvalueCnt = readUI16(operands);
+				out << "\t{\n";
+				out << "\t\tFunction* func = new Function(" << protoIdx << ", " << argCnt << ", " << upvalueCnt << ");\n";
+				for(uint16_t i = 0; i < upvalueCnt; i++) {
+					int16_t idx = readI16(operands);
+					out << "\t\tfunc->upvalues[" << i << "] = ";
+					if(idx >= 0)
+						out << "rt.captureUpvalue(fp + " << idx << ");\n";
+					else
+						out << "closure->upvalues[" << (-idx-1) << "];\n";
+				}
+				out << "\t\t" << slot(h) << " = Value(func);\n";
+				out << "\t}\n";
+				out << "\tGC::step();\n";
+				break;
+			} case Opcode::MAKE_LIST: {
+				uint16_t valueCnt = readUI16(operands);
+				out << "\t" << slot(h - valueCnt) << " = Value(new List(std::vector<Value>(fp + "
+					<< (h - valueCnt) << ", fp + " << h << ")));\n";
+				out << "\tGC::step();\n";
+				break;
+			} case Opcode::MAKE_METHOD: {
+				uint16_t nsConstantIdx = readUI16(operands);
+				uint16_t nameConstantIdx = readUI16(operands);
+				out << "\t" << top << " = Value(new Method(" << top << ", rt.getMethod(methodCache[" << methodCnt++ << "], "
+					<< stringConstant(nsConstantIdx) << ", " << stringConstant(nameConstantIdx) << ")));\n";
+				out << "\tGC::step();\n";
+				break;
+			} case Opcode::CALL_METHOD: {
+				uint16_t nsConstantIdx = readUI16(operands);
+				uint16_t nameConstantIdx = readUI16(operands);
+				uint16_t argCnt = readUI16(operands);
+				int32_t receiver = h - 1 - argCnt;
+				out << "\t" << slot(receiver) << " = rt.getMethod(methodCache[" << methodCnt++ << "], "
+					<< stringConstant(nsConstantIdx) << ", " << stringConstant(nameConstantIdx) << ")->call(fp + "
+					<< receiver << ", " << (argCnt + 1) << ");\n";
+				out << "\tGC::step();\n";
+				break;
+			} case Opcode::LOCAL_LOCAL: {
+				int16_t left = readI16(operands);
+				out << "\t" << slot(h) << " = " << slot(left) << ";\n";
+				out << "\t" << slot(h+1) << " = " << slot(readI16(operands)) << ";\n";
+				break;
+			} case Opcode::LOCAL_CONSTANT: {
+				int16_t idx = readI16(operands);
+				out << "\t" << slot(h) << " = " << slot(idx) << ";\n";
+				out << "\t" << slot(h+1) << " = " << constant(readUI16(operands)) << ";\n";
+				break;
+			} case Opcode::INC_LOCAL: {
+				std::string local = slot(readI16(operands));
+				out << "\t" << local << " = AotRuntime::addInt(" << local << ", " << constant(readUI16(operands)) << ");\n";
+				break;
+			} case Opcode::ADD_INT_SET_LOCAL:
+				out << "\t" << slot(readI16(operands)) << " = AotRuntime::addInt(" << second << ", " << top << ");\n";
+				break;
+			case Opcode::JUMP_IF_NOT_LESS_INT:
+			case Opcode::JUMP_IF_NOT_LESS_OR_EQ_INT: {
+				std::string cmp = op == Opcode::JUMP_IF_NOT_LESS_INT ? "lessInt" : "lessOrEqInt";
+				out << "\tif(!AotRuntime::" << cmp << "(" << second << ", " << top << ")) goto L" << (next + readI16(operands)) << ";\n";
+				break;
+			} case Opcode::JUMP_IF_NOT_LESS_LOCAL_LOCAL:
+			case Opcode::JUMP_IF_NOT_LESS_LOCAL_CONSTANT: {
+				std::string left = slot(readI16(operands));
+				std::string right = op == Opcode::JUMP_IF_NOT_LESS_LOCAL_LOCAL ? slot(readI16(operands)) : constant(readUI16(operands));
+				out << "\tif(!AotRuntime::lessInt(" << left << ", " << right << ")) goto L" << (next + readI16(operands)) << ";\n";
+				break;
+			} default:
+				throw std::runtime_error("Cannot translate " + opcodeDesc(op));
+			}
+		}
+		
+		if(isJumpTarget[code.size()])
+			out << "L" << code.size() << ":\n";
+		out << closeLocals;
+		out << "\treturn Value::nil();\n";
+	}
+};
+
+}
+
+std::string translateToCpp(Chunk& chunk) {
+	return Translator(chunk).translate();
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <string>
+
+#include "chunk.hpp"
+
+// Translates a chunk to a standalone C++ program, with one function per
+// function prototype, running against the AOT runtime (vm/aot_runtime.hpp).
+// The program is built by compiling it with -Isrc and linking it with every
+// object of Somiré except main.o (see the "lib" target of the Makefile).
+std::string translateToCpp(Chunk& chunk);
@@ -1,4 +1,6 @@
 #include "chunk.hpp"
+#include "verifier.hpp"
+#include "registers.hpp"
 
 #include <stdexcept>
 #include <sstream>
@@ -37,6 +39,47 @@ std::unordered_map<Opcode, std::string> opcodeDescTable = {
 	{Opcode::MAKE_LIST, "MAKE_LIST"},
 	{Opcode::MAKE_METHOD, "MAKE_METHOD"},
 	{Opcode::INDEX, "INDEX"},
+	{Opcode::ADD_INT, "ADD_INT"},
+	{Opcode::SUB_INT, "SUB_INT"},
+	{Opcode::MUL_INT, "MUL_INT"},
+	{Opcode::MOD_INT, "MOD_INT"},
+	{Opcode::ADD_REAL, "ADD_REAL"},
+	{Opcode::SUB_REAL, "SUB_REAL"},
+	{Opcode::MUL_REAL, "MUL_REAL"},
+	{Opcode::DIV_REAL, "DIV_REAL"},
+	{Opcode::MOD_REAL, "MOD_REAL"},
+	{Opcode::EQUALS_INT, "EQUALS_INT"},
+	{Opcode::LESS_INT, "LESS_INT"},
+	{Opcode::LESS_OR_EQ_INT, "LESS_OR_EQ_INT"},
+	{Opcode::LESS_REAL, "LESS_REAL"},
+	{Opcode::LESS_OR_EQ_REAL, "LESS_OR_EQ_REAL"},
+	{Opcode::INDEX_LIST_INT, "INDEX_LIST_INT"},
+	{Opcode::CALL_METHOD, "CALL_METHOD"},
+	{Opcode::TAIL_CALL, "TAIL_CALL"},
+	{Opcode::LOCAL_LOCAL, "LOCAL_LOCAL"},
+	{Opcode::LOCAL_CONSTANT, "LOCAL_CONSTANT"},
+	{Opcode::INC_LOCAL, "INC_LOCAL"},
+	{Opcode::ADD_INT_SET_LOCAL, "ADD_INT_SET_LOCAL"},
+	{Opcode::JUMP_IF_NOT_LESS_INT, "JUMP_IF_NOT_LESS_INT"},
+	{Opcode::JUMP_IF_NOT_LESS_OR_EQ_INT, "JUMP_IF_NOT_LESS_OR_EQ_INT"},
+	{Opcode::JUMP_IF_NOT_LESS_LOCAL_LOCAL, "JUMP_IF_NOT_LESS_LOCAL_LOCAL"},
+	{Opcode::JUMP_IF_NOT_LESS_LOCAL_CONSTANT, "JUMP_IF_NOT_LESS_LOCAL_CONSTANT"},
+	{Opcode::GLOBAL_SLOT, "GLOBAL_SLOT"},
+	{Opcode::MAKE_METHOD_SLOT, "MAKE_METHOD_SLOT"},
+	{Opcode::CALL_METHOD_SLOT, "CALL_METHOD_SLOT"},
+	{Opcode::JIT_RESUME, "JIT_RESUME"},
+	{Opcode::QUICK_PLUS_INT, "QUICK_PLUS_INT"},
+	{Opcode::QUICK_PLUS_REAL, "QUICK_PLUS_REAL"},
+	{Opcode::QUICK_MINUS_INT, "QUICK_MINUS_INT"},
+	{Opcode::QUICK_MINUS_REAL, "QUICK_MINUS_REAL"},
+	{Opcode::QUICK_MULTIPLY_INT, "QUICK_MULTIPLY_INT"},
+	{Opcode::QUICK_MULTIPLY_REAL, "QUICK_MULTIPLY_REAL"},
+	{Opcode::QUICK_EQUALS_INT, "QUICK_EQUALS_INT"},
+	{Opcode::QUICK_LESS_INT, "QUICK_LESS_INT"},
+	{Opcode::QUICK_LESS_REAL, "QUICK_LESS_REAL"},
+	{Opcode::QUICK_LESS_OR_EQ_INT, "QUICK_LESS_OR_EQ_INT"},
+	{Opcode::QUICK_LESS_OR_EQ_REAL, "QUICK_LESS_OR_EQ_REAL"},
+	{Opcode::QUICK_INDEX_LIST, "QUICK_INDEX_LIST"},
 };
 
 std::string opcodeDesc(Opcode opcode) {
@@ -46,6 +89,20 @@ std::string opcodeDesc(Opcode opcode) {
 	return it->second;
 }
 
+bool isJump(Opcode opcode) {
+	switch(opcode) {
+	case Opcode::JUMP_IF_NOT:
+	case Opcode::JUMP:
+	case Opcode::JUMP_IF_NOT_LESS_INT:
+	case Opcode::JUMP_IF_NOT_LESS_OR_EQ_INT:
+	case Opcode::JUMP_IF_NOT_LESS_LOCAL_LOCAL:
+	case Opcode::JUMP_IF_NOT_LESS_LOCAL_CONSTANT:
+		return true;
+	default:
+		return false;
+	}
+}
+
 int16_t computeJump(uint32_t from, uint32_t to) {
 	int32_t relJmp = (int32_t) to - (int32_t) from;
 	if(relJmp < std::numeric_limits<int16_t>::min() || std::numeric_limits<int16_t>::max() < relJmp)
@@ -53,7 +110,7 @@ int16_t computeJump(uint32_t from, uint32_t to) {
 	return (int16_t) relJmp;
 }
 
-FunctionChunk::FunctionChunk() : codeOut(code) {}
+FunctionChunk::FunctionChunk() : codeOut(code), maxStack(0) {}
 
 void FunctionChunk::fillInJump(uint32_t pos) {
 	int16_t x = computeJump(pos + 2, code.size());
@@ -61,9 +118,12 @@ void FunctionChunk::fillInJump(uint32_t pos) {
 	writeI16(it, x);
 }
 
-Chunk::Chunk() : constants(new List()) {}
+Chunk::Chunk() : constants(new List()), isa(Isa::STACK), verified(false) {}
 
 void Chunk::writeToFile(std::ofstream& fs) {
+	if(isa != Isa::STACK)
+		throw std::runtime_error("Only stack code can be written to bytecode files");
+	
 	fs.write((const char*) magicBytes.data(), magicBytes.size());
 	
 	std::ostream_iterator<char> it(fs);
@@ -103,7 +163,7 @@ std::unique_ptr<Chunk> Chunk::loadFromFile(std::ifstream& fs) {
 	std::istreambuf_iterator<char> it(fs);
 	
 	uint16_t constantCnt = readUI16(it);
-	for(uint8_t i = 0; i < constantCnt; i++) {
+	for(uint16_t i = 0; i < constantCnt; i++) {
 		chunk->loadConstantFromFile(it);
 	}
 	
@@ -114,6 +174,7 @@ std::unique_ptr<Chunk> Chunk::loadFromFile(std::ifstream& fs) {
 		fs.read((char*) chunk->functions.back()->code.data(), codeSize);
 	}
 	
+	verifyChunk(*chunk);
 	return chunk;
 }
 
@@ -128,6 +189,10 @@ std::string Chunk::list() {
 	
 	for(uint32_t i = 0; i < functions.size(); i++) {
 		res << "Function prototype " + std::to_string(i) + ":\n";
+		if(isa == Isa::REGISTER) {
+			res << listRegisterCode(*functions[i]) << "\n";
+			continue;
+		}
 		auto it = functions[i]->code.begin();
 		while(it != functions[i]->code.end()) {
 			Opcode op = static_cast<Opcode>(readUI8(it));
@@ -146,22 +211,45 @@ std::string Chunk::list() {
 			}
 			case Opcode::SET_LOCAL:
 			case Opcode::LOCAL:
+			case Opcode::ADD_INT_SET_LOCAL:
 				res << " " << (int) readI16(it);
 				break;
+			case Opcode::LOCAL_LOCAL:
+				res << " " << (int) readI16(it) << " " << (int) readI16(it);
+				break;
+			case Opcode::LOCAL_CONSTANT:
+			case Opcode::INC_LOCAL:
+				res << " " << (int) readI16(it) << " " << (int) readUI16(it);
+				break;
 			case Opcode::CONSTANT:
 			case Opcode::POP:
 			case Opcode::GLOBAL:
+			case Opcode::GLOBAL_SLOT:
 			case Opcode::CALL:
+			case Opcode::TAIL_CALL:
 			case Opcode::MAKE_LIST:
 				res << " " << (int) readUI16(it);
 				break;
 			case Opcode::MAKE_METHOD:
+			case Opcode::MAKE_METHOD_SLOT:
 				res << " " << (int) readUI16(it) << " " << (int) readUI16(it);
 				break;
+			case Opcode::CALL_METHOD:
+			case Opcode::CALL_METHOD_SLOT:
+				res << " " << (int) readUI16(it) << " " << (int) readUI16(it) << " " << (int) readUI16(it);
+				break;
 			case Opcode::JUMP_IF_NOT:
 			case Opcode::JUMP:
+			case Opcode::JUMP_IF_NOT_LESS_INT:
+			case Opcode::JUMP_IF_NOT_LESS_OR_EQ_INT:
 				res << " " << (int) readI16(it);
 				break;
+			case Opcode::JUMP_IF_NOT_LESS_LOCAL_LOCAL:
+				res << " " << (int) readI16(it) << " " << (int) readI16(it) << " " << (int) readI16(it);
+				break;
+			case Opcode::JUMP_IF_NOT_LESS_LOCAL_CONSTANT:
+				res << " " << (int) readI16(it) << " " << (int) readUI16(it) << " " << (int) readI16(it);
+				break;
 			default:
 				break;
 			}
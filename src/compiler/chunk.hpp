@@ -35,10 +35,38 @@ enum class Opcode : uint8_t {
 	JUMP,
 	CALL, RETURN,
 	MAKE_FUNC, MAKE_LIST, MAKE_METHOD,
-	INDEX
+	INDEX,
+	// Type-specialized variants, emitted when the operand types are known statically
+	ADD_INT, SUB_INT, MUL_INT, MOD_INT,
+	ADD_REAL, SUB_REAL, MUL_REAL, DIV_REAL, MOD_REAL,
+	EQUALS_INT,
+	LESS_INT, LESS_OR_EQ_INT,
+	LESS_REAL, LESS_OR_EQ_REAL,
+	INDEX_LIST_INT,
+	CALL_METHOD, TAIL_CALL,
+	// Superinstructions, fused from common sequences by the peephole optimizer
+	LOCAL_LOCAL, LOCAL_CONSTANT,
+	INC_LOCAL, ADD_INT_SET_LOCAL,
+	JUMP_IF_NOT_LESS_INT, JUMP_IF_NOT_LESS_OR_EQ_INT,
+	JUMP_IF_NOT_LESS_LOCAL_LOCAL, JUMP_IF_NOT_LESS_LOCAL_CONSTANT,
+	// Linked by the VM before execution: operands are slots in its global table
+	GLOBAL_SLOT, MAKE_METHOD_SLOT, CALL_METHOD_SLOT,
+	// Only in the decoded code of the VM (see vm/decode.hpp): goes back to
+	// compiled code after the interpreter ran an instruction for it
+	JIT_RESUME,
+	// Only in decoded code too: generic instructions quickened by the VM for
+	// the operand types seen at run time, with a guard
+	QUICK_PLUS_INT, QUICK_PLUS_REAL, QUICK_MINUS_INT, QUICK_MINUS_REAL,
+	QUICK_MULTIPLY_INT, QUICK_MULTIPLY_REAL,
+	QUICK_EQUALS_INT,
+	QUICK_LESS_INT, QUICK_LESS_REAL, QUICK_LESS_OR_EQ_INT, QUICK_LESS_OR_EQ_REAL,
+	QUICK_INDEX_LIST
 };
 
 std::string opcodeDesc(Opcode opcode);
+// Jump instructions have their relative jump as last operand, counted from the
+// end of the instruction
+bool isJump(Opcode opcode);
 
 template<typename O>
 void writeUI8(O& it, uint8_t x);
@@ -66,6 +94,16 @@ int32_t readI32(I& it);
 template<typename I>
 double readDouble(I& it);
 
+template<typename I>
+void skipInstruction(I& it);
+// Offset jumped to by the jump instruction ending at it
+template<typename I>
+uint32_t jumpTarget(I begin, I it);
+// Marks the offsets jumped to in the code of a function, and tells whether it
+// makes closures, which may capture its locals
+template<typename C>
+std::vector<bool> findJumpTargets(const C& code, bool* makesClosures = nullptr);
+
 int16_t computeJump(uint32_t from, uint32_t to);
 
 // /!\ Very touchy!
@@ -75,6 +113,7 @@ class FunctionChunk {
 public:
 	std::vector<uint8_t> code;
 	std::back_insert_iterator<std::vector<uint8_t>> codeOut;
+	uint32_t maxStack; // computed by the verifier
 	
 	FunctionChunk();
 	FunctionChunk(const FunctionChunk&) = delete;
@@ -82,10 +121,18 @@ public:
 	void fillInJump(uint32_t pos);
 };
 
+// Instruction set of the code of a chunk
+enum class Isa : uint8_t {
+	STACK, // Opcode, the format of bytecode files
+	REGISTER // RegOpcode (see registers.hpp), translated from verified stack code
+};
+
 class Chunk {
 public:
 	GC::Root<List> constants;
 	std::vector<std::unique_ptr<FunctionChunk>> functions;
+	Isa isa;
+	bool verified;
 	
 	Chunk();
 	
@@ -83,6 +83,70 @@ double readDouble(I& it) {
 	return reinterpret_cast<double&>(x);
 }
 
+template<typename I>
+void skipInstruction(I& it) {
+	Opcode op = (Opcode) readUI8(it);
+	switch(op) {
+	case Opcode::MAKE_FUNC: {
+		it += 4;
+		uint16_t upvalueCnt = readUI16(it);
+		it += 2*upvalueCnt;
+		break;
+	} case Opcode::CONSTANT:
+	case Opcode::POP:
+	case Opcode::SET_LOCAL:
+	case Opcode::LOCAL:
+	case Opcode::GLOBAL:
+	case Opcode::GLOBAL_SLOT:
+	case Opcode::JUMP_IF_NOT:
+	case Opcode::JUMP:
+	case Opcode::CALL:
+	case Opcode::TAIL_CALL:
+	case Opcode::MAKE_LIST:
+	case Opcode::ADD_INT_SET_LOCAL:
+	case Opcode::JUMP_IF_NOT_LESS_INT:
+	case Opcode::JUMP_IF_NOT_LESS_OR_EQ_INT:
+		it += 2;
+		break;
+	case Opcode::MAKE_METHOD:
+	case Opcode::MAKE_METHOD_SLOT:
+	case Opcode::LOCAL_LOCAL:
+	case Opcode::LOCAL_CONSTANT:
+	case Opcode::INC_LOCAL:
+		it += 4;
+		break;
+	case Opcode::CALL_METHOD:
+	case Opcode::CALL_METHOD_SLOT:
+	case Opcode::JUMP_IF_NOT_LESS_LOCAL_LOCAL:
+	case Opcode::JUMP_IF_NOT_LESS_LOCAL_CONSTANT:
+		it += 6;
+		break;
+	default:
+		break;
+	}
+}
+
+template<typename I>
+uint32_t jumpTarget(I begin, I it) {
+	I jumpOperand = it - 2;
+	return (it - begin) + readI16(jumpOperand);
+}
+
+template<typename C>
+std::vector<bool> findJumpTargets(const C& code, bool* makesClosures) {
+	std::vector<bool> isJumpTarget(code.size() + 1, false);
+	if(makesClosures) *makesClosures = false;
+	for(auto it = code.begin(); it != code.end();) {
+		Opcode op = (Opcode) *it;
+		if(op == Opcode::MAKE_FUNC && makesClosures)
+			*makesClosures = true;
+		skipInstruction(it);
+		if(isJump(op))
+			isJumpTarget[jumpTarget(code.begin(), it)] = true;
+	}
+	return isJumpTarget;
+}
+
 template <typename O>
 void Chunk::writeConstantToFile(O& it, Value val) {
 	if(val.isNil()) {
@@ -129,8 +193,9 @@ void Chunk::loadConstantFromFile(I& it) {
 	case ConstantType::STR: {
 		uint32_t len = readUI32(it);
 		std::string str(len, '\0');
-		std::copy_n(it, len, str.begin());
-		if(len > 0) ++it;
+		for(uint32_t i = 0; i < len; i++) {
+			str[i] = *it++;
+		}
 		constants->vec.emplace_back(new String(str));
 		break;
 	}}
@@ -1,4 +1,6 @@
 #include "compiler.hpp"
+#include "verifier.hpp"
+#include "peephole.hpp"
 
 #include <unordered_set>
 
@@ -67,10 +69,13 @@ Compiler::Compiler() : types(new TypeNamespace()), globals(new TypeNamespace())
 }
 
 std::unique_ptr<Chunk> Compiler::compileProgram(std::unique_ptr<Node> ast) {
+	GC::HandleScope scope; // for the types made while typing expressions
 	curChunk = std::unique_ptr<Chunk>(new Chunk());
 	if(ast->type != NodeType::BLOCK)
 		throw CompileError("Expected block to compile, got " + nodeTypeDesc(ast->type));
 	compileFunction(static_cast<NodeBlock&>(*ast), {}, {}, anyType);
+	fuseSuperinstructions(*curChunk);
+	verifyChunk(*curChunk);
 	return std::move(curChunk);
 }
 
@@ -191,8 +196,19 @@ bool Compiler::compileStatement(FunctionChunk& curFunc, Node& stat, Context& ctx
 	} case NodeType::RETURN: {
 		NodeExp& expr = *static_cast<NodeReturn&>(stat).expr;
 		Type* resType2 = typeExpression(expr, ctx);
-		compileExpression(curFunc, expr, ctx);
-		writeUI8(curFunc.codeOut, (uint8_t) Opcode::RETURN);
+		if(expr.type == NodeType::CALL && static_cast<NodeCall&>(expr).func->type != NodeType::PROP) {
+			// Tail call: the callee can reuse the current frame
+			NodeCall& call = static_cast<NodeCall&>(expr);
+			for(auto& arg : call.args) {
+				compileExpression(curFunc, *arg, ctx);
+			}
+			compileExpression(curFunc, *call.func, ctx);
+			writeUI8(curFunc.codeOut, (uint8_t) Opcode::TAIL_CALL);
+			writeUI16(curFunc.codeOut, (uint16_t) call.args.size());
+		} else {
+			compileExpression(curFunc, expr, ctx);
+			writeUI8(curFunc.codeOut, (uint8_t) Opcode::RETURN);
+		}
 		if(!resType2->canBeAssignedTo(resType)) {
 			throw CompileError("Returning " + resType2->getDesc() + " in function with return type " + resType->getDesc());
 		}
@@ -214,23 +230,33 @@ std::unordered_map<std::string, Opcode> binaryOps = {
 	{"index", Opcode::INDEX}
 };
 
+// Variants of generic opcodes which can be used when both operands are known to be ints/reals
+std::unordered_map<Opcode, Opcode> intOps = {
+	{Opcode::BIN_PLUS, Opcode::ADD_INT}, {Opcode::BIN_MINUS, Opcode::SUB_INT}, {Opcode::MULTIPLY, Opcode::MUL_INT}, {Opcode::MODULO, Opcode::MOD_INT},
+	{Opcode::EQUALS, Opcode::EQUALS_INT}, {Opcode::LESS, Opcode::LESS_INT}, {Opcode::LESS_OR_EQ, Opcode::LESS_OR_EQ_INT}
+};
+std::unordered_map<Opcode, Opcode> realOps = {
+	{Opcode::BIN_PLUS, Opcode::ADD_REAL}, {Opcode::BIN_MINUS, Opcode::SUB_REAL}, {Opcode::MULTIPLY, Opcode::MUL_REAL}, {Opcode::DIVIDE, Opcode::DIV_REAL}, {Opcode::MODULO, Opcode::MOD_REAL},
+	{Opcode::LESS, Opcode::LESS_REAL}, {Opcode::LESS_OR_EQ, Opcode::LESS_OR_EQ_REAL}
+};
+
 Type* Compiler::typeExpression(NodeExp& exp, Context& ctx) {
 	switch(exp.type) {
 	case NodeType::INT:
-		exp.valueType.reset(intType);
+		exp.valueType = intType;
 		break;
 	case NodeType::REAL:
-		exp.valueType.reset(realType);
+		exp.valueType = realType;
 		break;
 	case NodeType::STR:
-		exp.valueType.reset(stringType);
+		exp.valueType = stringType;
 		break;
 	case NodeType::SYM: {
 		NodeSymbol& exp2 = static_cast<NodeSymbol&>(exp);
 		if(exp2.val == "nil") {
-			exp.valueType.reset(nilType);
+			exp.valueType = nilType;
 		} else if(exp2.val == "true" || exp2.val == "false") {
-			exp.valueType.reset(boolType);
+			exp.valueType = boolType;
 		} else {
 			throw CompileError("Unexpected keyword in expression: " + exp2.val);
 		}
@@ -239,11 +265,11 @@ Type* Compiler::typeExpression(NodeExp& exp, Context& ctx) {
 		NodeId& exp2 = static_cast<NodeId&>(exp);
 		std::optional<Variable> var = ctx.getVariable(exp2.val);
 		if(var) {
-			exp.valueType.reset(var->type);
+			exp.valueType = var->type;
 		} else {
 			auto it = globals->map.find(exp2.val);
 			if(it != globals->map.end()) {
-				exp.valueType.reset(it->second);
+				exp.valueType = it->second;
 			} else {
 				throw CompileError("Trying to access unknown variable: " + exp2.val);
 			}
@@ -253,9 +279,9 @@ Type* Compiler::typeExpression(NodeExp& exp, Context& ctx) {
 		NodeUnary& exp2 = static_cast<NodeUnary&>(exp);
 		Type* valType = typeExpression(*exp2.val, ctx);
 		if(exp2.op == "-") {
-			exp.valueType.reset(valType);
+			exp.valueType = valType;
 		} else if(exp2.op == "not") {
-			exp.valueType.reset(boolType);
+			exp.valueType = boolType;
 		} else {
 			throw CompileError("Unknown unary operator: " + exp2.op);
 		}
@@ -268,36 +294,36 @@ Type* Compiler::typeExpression(NodeExp& exp, Context& ctx) {
 		     r1 = type1->canBeAssignedTo(realType), r2 = type2->canBeAssignedTo(realType);
 		if(numericOps.find(exp2.op) != numericOps.end()) {
 			if(i1 && i2) {
-				exp.valueType.reset(intType);
+				exp.valueType = intType;
 			} else if(r1 && r2) {
-				exp.valueType.reset(realType);
+				exp.valueType = realType;
 			} else {
 				throw CompileError("Trying to perform arithmetic on " + type1->getDesc() + " and " + type2->getDesc());
 			}
 		} else if(comparisonOps.find(exp2.op) != comparisonOps.end()) {
 			if(r1 && r2) {
-				exp.valueType.reset(boolType);
+				exp.valueType = boolType;
 			} else {
 				throw CompileError("Trying to compare " + type1->getDesc() + " and " + type2->getDesc());
 			}
 		} else if(exp2.op == "==" || exp2.op == "!=") {
-			exp.valueType.reset(boolType);
+			exp.valueType = boolType;
 		} else if(exp2.op == "/" || exp2.op == "^") {
 			if(r1 && r2) {
-				exp.valueType.reset(realType);
+				exp.valueType = realType;
 			} else {
 				throw CompileError("Trying to perform real operations on " + type1->getDesc() + " and " + type2->getDesc());
 			}
 		} else if(exp2.op == "and" || exp2. op == "or") {
 			if(type1->canBeAssignedTo(boolType) && type2->canBeAssignedTo(boolType)) {
-				exp.valueType.reset(boolType);
+				exp.valueType = boolType;
 			} else {
 				throw CompileError("Trying to perform boolean operations on " + type1->getDesc() + " and " + type2->getDesc());
 			}
 		} else if(exp2.op == "index") {
 			ListType* listType = dynamic_cast<ListType*>(type1);
 			if(listType && listType->elemType && type2->canBeAssignedTo(intType)) {
-				exp.valueType.reset(listType->elemType);
+				exp.valueType = listType->elemType;
 			} else {
 				throw CompileError("Trying to index " + type1->getDesc() + " with " + type2->getDesc());
 			}
@@ -315,7 +341,7 @@ Type* Compiler::typeExpression(NodeExp& exp, Context& ctx) {
 		
 		FunctionType* funcType2;
 		if(funcType->canBeAssignedTo(macroType)) {
-			exp.valueType.reset(anyType);
+			exp.valueType = anyType;
 		} else if(funcType2 = dynamic_cast<FunctionType*>(funcType)) {
 			uint32_t expected = funcType2->argTypes.size();
 			uint32_t got = argTypes.size();
@@ -325,7 +351,7 @@ Type* Compiler::typeExpression(NodeExp& exp, Context& ctx) {
 				if(!argTypes[i]->canBeAssignedTo(funcType2->argTypes[i]))
 					throw CompileError("Cannot assign " + argTypes[i]->getDesc() + " to " + funcType2->argTypes[i]->getDesc() + " argument");
 			}
-			exp.valueType.reset(funcType2->resType);
+			exp.valueType = funcType2->resType;
 		} else {
 			throw CompileError("Trying to call " + funcType->getDesc());
 		}
@@ -338,7 +364,7 @@ Type* Compiler::typeExpression(NodeExp& exp, Context& ctx) {
 			argTypes.push_back(getType(*argTypeDesc));
 		}
 		Type* resType = getType(*exp2.resType);
-		exp.valueType.reset(new FunctionType(argTypes, resType));
+		exp.valueType = GC::handle(new FunctionType(argTypes, resType));
 		break;
 	} case NodeType::LIST: {
 		NodeList& exp2 = static_cast<NodeList&>(exp);
@@ -355,7 +381,7 @@ Type* Compiler::typeExpression(NodeExp& exp, Context& ctx) {
 				elemType = elemType2;
 			}
 		}
-		exp.valueType.reset(new ListType(elemType));
+		exp.valueType = GC::handle(new ListType(elemType));
 		break;
 	} case NodeType::PROP: {
 		NodeProp& exp2 = static_cast<NodeProp&>(exp);
@@ -364,12 +390,12 @@ Type* Compiler::typeExpression(NodeExp& exp, Context& ctx) {
 		if(!propType) {
 			throw CompileError("Type " + valType->getDesc() + " does not have a method named " + exp2.prop);
 		}
-		exp.valueType.reset(propType);
+		exp.valueType = GC::handle(propType);
 		break;
 	} default:
 		throw CompileError("Expression type not implemented: " + nodeTypeDesc(exp.type));
 	}
-	return exp.valueType.get();
+	return exp.valueType;
 }
 
 void Compiler::compileExpression(FunctionChunk& curFunc, NodeExp& expr, Context& ctx) {
@@ -423,20 +449,34 @@ void Compiler::compileExpression(FunctionChunk& curFunc, NodeExp& expr, Context&
 		compileExpression(curFunc, *expr2.right, ctx);
 		auto it = binaryOps.find(expr2.op);
 		if(it != binaryOps.end()) {
-			writeUI8(curFunc.codeOut, (uint8_t) it->second);
+			writeUI8(curFunc.codeOut, (uint8_t) specializeBinaryOp(it->second, expr2));
 		} else if(expr2.op == "!=") {
-			writeUI8(curFunc.codeOut, (uint8_t) Opcode::EQUALS);
+			writeUI8(curFunc.codeOut, (uint8_t) specializeBinaryOp(Opcode::EQUALS, expr2));
 			writeUI8(curFunc.codeOut, (uint8_t) Opcode::NOT);
 		} else if(expr2.op == ">") {
-			writeUI8(curFunc.codeOut, (uint8_t) Opcode::LESS_OR_EQ);
+			writeUI8(curFunc.codeOut, (uint8_t) specializeBinaryOp(Opcode::LESS_OR_EQ, expr2));
 			writeUI8(curFunc.codeOut, (uint8_t) Opcode::NOT);
 		} else if(expr2.op == ">=") {
-			writeUI8(curFunc.codeOut, (uint8_t) Opcode::LESS);
+			writeUI8(curFunc.codeOut, (uint8_t) specializeBinaryOp(Opcode::LESS, expr2));
 			writeUI8(curFunc.codeOut, (uint8_t) Opcode::NOT);
 		}
 		break;
 	} case NodeType::CALL: {
 		NodeCall& expr2 = static_cast<NodeCall&>(expr);
+		if(expr2.func->type == NodeType::PROP) { // method call: no need to build a Method object
+			NodeProp& method = static_cast<NodeProp&>(*expr2.func);
+			compileExpression(curFunc, *method.val, ctx);
+			for(auto& arg : expr2.args) {
+				compileExpression(curFunc, *arg, ctx);
+			}
+			writeUI8(curFunc.codeOut, (uint8_t) Opcode::CALL_METHOD);
+			writeUI16(curFunc.codeOut, curChunk->constants->vec.size());
+			curChunk->constants->vec.emplace_back(new String(method.val->valueType->getNamespace()));
+			writeUI16(curFunc.codeOut, curChunk->constants->vec.size());
+			curChunk->constants->vec.emplace_back(new String(method.prop));
+			writeUI16(curFunc.codeOut, (uint16_t) expr2.args.size());
+			break;
+		}
 		for(auto& arg : expr2.args) {
 			compileExpression(curFunc, *arg, ctx);
 		}
@@ -453,7 +493,7 @@ void Compiler::compileExpression(FunctionChunk& curFunc, NodeExp& expr, Context&
 		if(expr2.argNames.size() > 0xffff)
 			throw CompileError("Too many arguments in function definition");
 		writeUI16(curFunc.codeOut, (uint16_t) expr2.argNames.size());
-		auto type = dynamic_cast<FunctionType*>(expr2.valueType.get());
+		auto type = dynamic_cast<FunctionType*>(expr2.valueType);
 		std::vector<int16_t> upvalues = compileFunction(static_cast<NodeBlock&>(*expr2.block), expr2.argNames, type->argTypes, type->resType, &ctx);
 		if(upvalues.size() > 0xffff)
 			throw CompileError("Too many upvalues in function definition");
@@ -487,6 +527,24 @@ void Compiler::compileExpression(FunctionChunk& curFunc, NodeExp& expr, Context&
 	}
 }
 
+Opcode Compiler::specializeBinaryOp(Opcode op, NodeBinary& expr) {
+	Type* type1 = expr.left->valueType;
+	Type* type2 = expr.right->valueType;
+	if(op == Opcode::INDEX) {
+		// typeExpression already checked that the index is an int
+		return dynamic_cast<ListType*>(type1) ? Opcode::INDEX_LIST_INT : op;
+	}
+	if(type1->canBeAssignedTo(intType) && type2->canBeAssignedTo(intType)) {
+		auto it = intOps.find(op);
+		if(it != intOps.end()) return it->second;
+	}
+	if(type1->canBeAssignedTo(realType) && type2->canBeAssignedTo(realType)) {
+		auto it = realOps.find(op);
+		if(it != realOps.end()) return it->second;
+	}
+	return op;
+}
+
 void Compiler::compileConstant(FunctionChunk& curFunc, Value val) {
 	writeUI8(curFunc.codeOut, (uint8_t) Opcode::CONSTANT);
 	writeUI16(curFunc.codeOut, (uint16_t) curChunk->constants->vec.size());
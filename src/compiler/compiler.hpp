@@ -58,5 +58,8 @@ private:
 	bool compileStatement(FunctionChunk& curFunc, Node& stat, Context& ctx, Type* resType);
 	Type* typeExpression(NodeExp& exp, Context& ctx);
 	void compileExpression(FunctionChunk& curFunc, NodeExp& expr, Context& ctx);
+	// The static types are not sound (a list may hold any value), so the typed
+	// opcodes chosen here still check the tags of their operands at run time
+	Opcode specializeBinaryOp(Opcode op, NodeBinary& expr);
 	void compileConstant(FunctionChunk& curFunc, Value val);
 };
@@ -0,0 +1,108 @@
+#include "peephole.hpp"
+
+#include <initializer_list>
+
+namespace {
+
+struct Instruction {
+	Opcode op;
+	std::vector<uint8_t> operands; // without the relative jump
+	int32_t target; // original offset of the jump target, -1 if not a jump
+	uint32_t pos; // original offset
+};
+
+// The fused sequences were chosen from the most frequent pairs of consecutive
+// opcodes in loop- and call-heavy programs (see the "profile-ops" target):
+// LOCAL CONSTANT, LOCAL LOCAL, ADD_INT SET_LOCAL and LESS_INT JUMP_IF_NOT,
+// each making up 10 to 20% of the dispatches, then the loop conditions and
+// counters ("while i < n", "i = i + 1") they are part of.
+void fuseFunction(FunctionChunk& func) {
+	std::vector<uint8_t>& code = func.code;
+	std::vector<Instruction> instrs;
+	std::vector<bool> isJumpTarget = findJumpTargets(code);
+	for(auto it = code.begin(); it != code.end();) {
+		auto start = it;
+		skipInstruction(it);
+		Instruction instr{ (Opcode) *start, std::vector<uint8_t>(start + 1, it), -1, (uint32_t) (start - code.begin()) };
+		if(isJump(instr.op)) {
+			instr.target = jumpTarget(code.begin(), it);
+			instr.operands.resize(instr.operands.size() - 2);
+		}
+		instrs.push_back(std::move(instr));
+	}
+	
+	std::vector<Instruction> fused;
+	for(size_t i = 0; i < instrs.size();) {
+		auto matches = [&](std::initializer_list<Opcode> ops) {
+			size_t k = 0;
+			for(Opcode op : ops) {
+				if(i + k >= instrs.size() || instrs[i+k].op != op) return false;
+				if(k > 0 && isJumpTarget[instrs[i+k].pos]) return false;
+				k++;
+			}
+			return true;
+		};
+		auto operands = [&](size_t k) -> std::vector<uint8_t>& { return instrs[i+k].operands; };
+		// Only proper locals are fused, upvalues keep the generic instructions
+		auto isLocal = [&](size_t k) {
+			auto it = operands(k).begin();
+			return readI16(it) >= 0;
+		};
+		auto fuse = [&](Opcode op, size_t cnt, std::initializer_list<size_t> operandsFrom) {
+			Instruction instr{ op, {}, instrs[i + cnt - 1].target, instrs[i].pos };
+			for(size_t k : operandsFrom) {
+				instr.operands.insert(instr.operands.end(), operands(k).begin(), operands(k).end());
+			}
+			fused.push_back(std::move(instr));
+			i += cnt;
+		};
+		
+		if(matches({ Opcode::LOCAL, Opcode::CONSTANT, Opcode::ADD_INT, Opcode::SET_LOCAL })
+				&& isLocal(0) && operands(0) == operands(3)) {
+			fuse(Opcode::INC_LOCAL, 4, { 0, 1 });
+		} else if(matches({ Opcode::LOCAL, Opcode::LOCAL, Opcode::LESS_INT, Opcode::JUMP_IF_NOT })
+				&& isLocal(0) && isLocal(1)) {
+			fuse(Opcode::JUMP_IF_NOT_LESS_LOCAL_LOCAL, 4, { 0, 1 });
+		} else if(matches({ Opcode::LOCAL, Opcode::CONSTANT, Opcode::LESS_INT, Opcode::JUMP_IF_NOT }) && isLocal(0)) {
+			fuse(Opcode::JUMP_IF_NOT_LESS_LOCAL_CONSTANT, 4, { 0, 1 });
+		} else if(matches({ Opcode::LESS_INT, Opcode::JUMP_IF_NOT })) {
+			fuse(Opcode::JUMP_IF_NOT_LESS_INT, 2, {});
+		} else if(matches({ Opcode::LESS_OR_EQ_INT, Opcode::JUMP_IF_NOT })) {
+			fuse(Opcode::JUMP_IF_NOT_LESS_OR_EQ_INT, 2, {});
+		} else if(matches({ Opcode::ADD_INT, Opcode::SET_LOCAL }) && isLocal(1)) {
+			fuse(Opcode::ADD_INT_SET_LOCAL, 2, { 1 });
+		} else if(matches({ Opcode::LOCAL, Opcode::LOCAL }) && isLocal(0) && isLocal(1)) {
+			fuse(Opcode::LOCAL_LOCAL, 2, { 0, 1 });
+		} else if(matches({ Opcode::LOCAL, Opcode::CONSTANT }) && isLocal(0)) {
+			fuse(Opcode::LOCAL_CONSTANT, 2, { 0, 1 });
+		} else {
+			fused.push_back(std::move(instrs[i]));
+			i++;
+		}
+	}
+	
+	// Jump targets are always the first instruction of a fused sequence
+	std::vector<uint32_t> newPos(code.size() + 1);
+	uint32_t size = 0;
+	for(Instruction& instr : fused) {
+		newPos[instr.pos] = size;
+		size += 1 + instr.operands.size() + (instr.target != -1 ? 2 : 0);
+	}
+	newPos[code.size()] = size;
+	
+	code.clear();
+	for(Instruction& instr : fused) {
+		writeUI8(func.codeOut, (uint8_t) instr.op);
+		std::copy(instr.operands.begin(), instr.operands.end(), func.codeOut);
+		if(instr.target != -1)
+			writeI16(func.codeOut, computeJump(code.size() + 2, newPos[instr.target]));
+	}
+}
+
+}
+
+void fuseSuperinstructions(Chunk& chunk) {
+	for(std::unique_ptr<FunctionChunk>& func : chunk.functions) {
+		fuseFunction(*func);
+	}
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "chunk.hpp"
+
+// Replaces common instruction sequences in the compiled code with
+// superinstructions, which do the same work in a single dispatch.
+// Sequences containing a jump target (except at their start) are left alone.
+void fuseSuperinstructions(Chunk& chunk);
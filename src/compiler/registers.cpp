@@ -0,0 +1,531 @@
+#include "registers.hpp"
+#include "verifier.hpp"
+
+#include <sstream>
+#include <stdexcept>
+
+std::unordered_map<RegOpcode, std::string> regOpcodeDescTable = {
+	{RegOpcode::MOVE, "MOVE"},
+	{RegOpcode::LOADK, "LOADK"},
+	{RegOpcode::GET_UPVALUE, "GET_UPVALUE"},
+	{RegOpcode::SET_UPVALUE, "SET_UPVALUE"},
+	{RegOpcode::GLOBAL, "GLOBAL"},
+	{RegOpcode::NEG, "NEG"},
+	{RegOpcode::NOT, "NOT"},
+	{RegOpcode::PLUS, "PLUS"},
+	{RegOpcode::MINUS, "MINUS"},
+	{RegOpcode::MULTIPLY, "MULTIPLY"},
+	{RegOpcode::DIVIDE, "DIVIDE"},
+	{RegOpcode::MODULO, "MODULO"},
+	{RegOpcode::POWER, "POWER"},
+	{RegOpcode::OR, "OR"},
+	{RegOpcode::AND, "AND"},
+	{RegOpcode::EQUALS, "EQUALS"},
+	{RegOpcode::LESS, "LESS"},
+	{RegOpcode::LESS_OR_EQ, "LESS_OR_EQ"},
+	{RegOpcode::INDEX, "INDEX"},
+	{RegOpcode::ADD_INT, "ADD_INT"},
+	{RegOpcode::SUB_INT, "SUB_INT"},
+	{RegOpcode::MUL_INT, "MUL_INT"},
+	{RegOpcode::MOD_INT, "MOD_INT"},
+	{RegOpcode::ADD_REAL, "ADD_REAL"},
+	{RegOpcode::SUB_REAL, "SUB_REAL"},
+	{RegOpcode::MUL_REAL, "MUL_REAL"},
+	{RegOpcode::DIV_REAL, "DIV_REAL"},
+	{RegOpcode::MOD_REAL, "MOD_REAL"},
+	{RegOpcode::EQUALS_INT, "EQUALS_INT"},
+	{RegOpcode::LESS_INT, "LESS_INT"},
+	{RegOpcode::LESS_OR_EQ_INT, "LESS_OR_EQ_INT"},
+	{RegOpcode::LESS_REAL, "LESS_REAL"},
+	{RegOpcode::LESS_OR_EQ_REAL, "LESS_OR_EQ_REAL"},
+	{RegOpcode::INDEX_LIST_INT, "INDEX_LIST_INT"},
+	{RegOpcode::JUMP, "JUMP"},
+	{RegOpcode::JUMP_IF_NOT, "JUMP_IF_NOT"},
+	{RegOpcode::JUMP_IF_NOT_LESS_INT, "JUMP_IF_NOT_LESS_INT"},
+	{RegOpcode::JUMP_IF_NOT_LESS_OR_EQ_INT, "JUMP_IF_NOT_LESS_OR_EQ_INT"},
+	{RegOpcode::CALL, "CALL"},
+	{RegOpcode::TAIL_CALL, "TAIL_CALL"},
+	{RegOpcode::CALL_METHOD, "CALL_METHOD"},
+	{RegOpcode::RETURN, "RETURN"},
+	{RegOpcode::RETURN_NIL, "RETURN_NIL"},
+	{RegOpcode::CLOSE, "CLOSE"},
+	{RegOpcode::MAKE_FUNC, "MAKE_FUNC"},
+	{RegOpcode::MAKE_LIST, "MAKE_LIST"},
+	{RegOpcode::MAKE_METHOD, "MAKE_METHOD"},
+	{RegOpcode::GLOBAL_SLOT, "GLOBAL_SLOT"},
+	{RegOpcode::CALL_METHOD_SLOT, "CALL_METHOD_SLOT"},
+	{RegOpcode::MAKE_METHOD_SLOT, "MAKE_METHOD_SLOT"},
+};
+
+std::string regOpcodeDesc(RegOpcode opcode) {
+	auto it = regOpcodeDescTable.find(opcode);
+	if(it == regOpcodeDescTable.end())
+		throw std::runtime_error("Unknown register opcode");
+	return it->second;
+}
+
+// Operand kinds, as a string of letters: r = register, k = RK operand,
+// c = constant, n = number, j = jump
+static const char* operandKinds(RegOpcode op) {
+	switch(op) {
+	case RegOpcode::MOVE: case RegOpcode::NEG: case RegOpcode::NOT:
+		return "rk";
+	case RegOpcode::LOADK: case RegOpcode::GLOBAL:
+		return "rc";
+	case RegOpcode::GET_UPVALUE: case RegOpcode::GLOBAL_SLOT:
+		return "rn";
+	case RegOpcode::SET_UPVALUE:
+		return "nk";
+	case RegOpcode::JUMP:
+		return "j";
+	case RegOpcode::JUMP_IF_NOT:
+		return "kj";
+	case RegOpcode::JUMP_IF_NOT_LESS_INT: case RegOpcode::JUMP_IF_NOT_LESS_OR_EQ_INT:
+		return "kkj";
+	case RegOpcode::CALL: case RegOpcode::TAIL_CALL: case RegOpcode::MAKE_LIST:
+		return "rn";
+	case RegOpcode::CALL_METHOD:
+		return "rccn";
+	case RegOpcode::CALL_METHOD_SLOT:
+		return "rncn";
+	case RegOpcode::RETURN:
+		return "k";
+	case RegOpcode::RETURN_NIL:
+		return "";
+	case RegOpcode::CLOSE:
+		return "r";
+	case RegOpcode::MAKE_FUNC:
+		return "rnnn"; // followed by the upvalues
+	case RegOpcode::MAKE_METHOD:
+		return "rkcc";
+	case RegOpcode::MAKE_METHOD_SLOT:
+		return "rknc";
+	default: // binary operators
+		return "rkk";
+	}
+}
+
+void skipRegInstruction(std::vector<uint8_t>::iterator& it) {
+	RegOpcode op = (RegOpcode) readUI8(it);
+	if(op == RegOpcode::MAKE_FUNC) {
+		it += 4;
+		uint16_t upvalueCnt = readUI16(it);
+		it += 2*upvalueCnt;
+		return;
+	}
+	it += 2 * std::char_traits<char>::length(operandKinds(op));
+}
+
+std::string listRegisterCode(FunctionChunk& func) {
+	std::stringstream res;
+	auto it = func.code.begin();
+	while(it != func.code.end()) {
+		RegOpcode op = (RegOpcode) readUI8(it);
+		res << regOpcodeDesc(op);
+		uint16_t operand;
+		for(const char* kind = operandKinds(op); *kind; kind++) {
+			operand = readUI16(it);
+			switch(*kind) {
+			case 'r': res << " r" << operand; break;
+			case 'k':
+				if(operand & RK_CONSTANT)
+					res << " k" << (operand & ~RK_CONSTANT);
+				else
+					res << " r" << operand;
+				break;
+			case 'c': res << " k" << operand; break;
+			case 'j': res << " " << (int) (int16_t) operand; break;
+			default: res << " " << operand; break;
+			}
+		}
+		if(op == RegOpcode::MAKE_FUNC) {
+			res << "\n  upvalues = [";
+			uint16_t upvalues = operand;
+			for(uint16_t i = 0; i < upvalues; i++) {
+				res << (int) readI16(it);
+				if(i != upvalues-1)
+					res << ",";
+			}
+			res << "]";
+		}
+		res << "\n";
+	}
+	return res.str();
+}
+
+namespace {
+
+// Where the value of a stack slot is, while translating
+struct Operand {
+	enum Kind : uint8_t {
+		REG, // in the register of its slot
+		LOCAL, // not copied yet from a local
+		CONST // not loaded yet from a constant
+	} kind;
+	uint16_t idx; // register or constant
+};
+
+class RegisterTranslator {
+public:
+	RegisterTranslator(Chunk& chunk, std::vector<int32_t>& heights, FunctionChunk& out)
+		: chunk(chunk), heights(heights), out(out) {}
+	
+	void translate(FunctionChunk& func) {
+		std::vector<uint8_t>& code = func.code;
+		if(func.maxStack >= RK_CONSTANT)
+			throw std::runtime_error("Function uses too many registers");
+		out.maxStack = func.maxStack;
+		
+		bool capturesLocals;
+		std::vector<bool> isJumpTarget = findJumpTargets(code, &capturesLocals);
+		
+		std::vector<uint32_t> newPos(code.size() + 1);
+		std::vector<std::pair<uint32_t, uint32_t>> jumps; // operand position, target
+		bool reachable = true;
+		
+		auto it = code.begin();
+		while(true) {
+			uint32_t pos = it - code.begin();
+			if(pos == 0 || isJumpTarget[pos] || heights[pos] == -1) {
+				// Values on the stack must be in their registers where paths merge,
+				// and the arguments are in theirs on entry
+				if(reachable) materializeAll();
+				reachable = heights[pos] != -1;
+				if(reachable) stack.assign(heights[pos], Operand{ Operand::REG, 0 });
+				for(uint32_t i = 0; i < stack.size(); i++) stack[i].idx = i;
+				lastDst = -1;
+			}
+			newPos[pos] = out.code.size();
+			if(it == code.end()) break;
+			
+			Opcode op = (Opcode) readUI8(it);
+			auto operands = it;
+			it = code.begin() + pos;
+			skipInstruction(it);
+			if(!reachable) continue;
+			uint16_t h = stack.size();
+			
+			auto jump = [&]() {
+				jumps.emplace_back(out.code.size(), jumpTarget(code.begin(), it));
+				writeI16(out.codeOut, 0);
+			};
+			auto binary = [&](RegOpcode rop) {
+				Operand right = pop();
+				Operand left = pop();
+				uint16_t b = rk(left, h-2);
+				uint16_t c = rk(right, h-1);
+				emitDst(rop, h-2);
+				writeUI16(out.codeOut, b);
+				writeUI16(out.codeOut, c);
+				push(h-2);
+			};
+			auto unary = [&](RegOpcode rop) {
+				uint16_t b = rk(pop(), h-1);
+				emitDst(rop, h-1);
+				writeUI16(out.codeOut, b);
+				push(h-1);
+			};
+			auto setLocal = [&](uint16_t local) {
+				Operand val = pop();
+				materializeLocal(local);
+				if(val.kind == Operand::REG && lastDst == val.idx) {
+					// Make the instruction which computed the value write it to the local
+					auto dst = out.code.begin() + lastDstPos;
+					writeUI16(dst, local);
+				} else if(!(val.kind == Operand::LOCAL && val.idx == local)) {
+					uint16_t b = rk(val, h-1);
+					emit(RegOpcode::MOVE);
+					writeUI16(out.codeOut, local);
+					writeUI16(out.codeOut, b);
+				}
+				lastDst = -1;
+			};
+			
+			switch(op) {
+			case Opcode::IGNORE:
+				pop();
+				break;
+			case Opcode::CONSTANT:
+				stack.push_back({ Operand::CONST, readUI16(operands) });
+				break;
+			case Opcode::UNI_MINUS: unary(RegOpcode::NEG); break;
+			case Opcode::NOT: unary(RegOpcode::NOT); break;
+			case Opcode::BIN_PLUS: binary(RegOpcode::PLUS); break;
+			case Opcode::BIN_MINUS: binary(RegOpcode::MINUS); break;
+			case Opcode::MULTIPLY: binary(RegOpcode::MULTIPLY); break;
+			case Opcode::DIVIDE: binary(RegOpcode::DIVIDE); break;
+			case Opcode::MODULO: binary(RegOpcode::MODULO); break;
+			case Opcode::POWER: binary(RegOpcode::POWER); break;
+			case Opcode::OR: binary(RegOpcode::OR); break;
+			case Opcode::AND: binary(RegOpcode::AND); break;
+			case Opcode::EQUALS: binary(RegOpcode::EQUALS); break;
+			case Opcode::LESS: binary(RegOpcode::LESS); break;
+			case Opcode::LESS_OR_EQ: binary(RegOpcode::LESS_OR_EQ); break;
+			case Opcode::INDEX: binary(RegOpcode::INDEX); break;
+			case Opcode::ADD_INT: binary(RegOpcode::ADD_INT); break;
+			case Opcode::SUB_INT: binary(RegOpcode::SUB_INT); break;
+			case Opcode::MUL_INT: binary(RegOpcode::MUL_INT); break;
+			case Opcode::MOD_INT: binary(RegOpcode::MOD_INT); break;
+			case Opcode::ADD_REAL: binary(RegOpcode::ADD_REAL); break;
+			case Opcode::SUB_REAL: binary(RegOpcode::SUB_REAL); break;
+			case Opcode::MUL_REAL: binary(RegOpcode::MUL_REAL); break;
+			case Opcode::DIV_REAL: binary(RegOpcode::DIV_REAL); break;
+			case Opcode::MOD_REAL: binary(RegOpcode::MOD_REAL); break;
+			case Opcode::EQUALS_INT: binary(RegOpcode::EQUALS_INT); break;
+			case Opcode::LESS_INT: binary(RegOpcode::LESS_INT); break;
+			case Opcode::LESS_OR_EQ_INT: binary(RegOpcode::LESS_OR_EQ_INT); break;
+			case Opcode::LESS_REAL: binary(RegOpcode::LESS_REAL); break;
+			case Opcode::LESS_OR_EQ_REAL: binary(RegOpcode::LESS_OR_EQ_REAL); break;
+			case Opcode::INDEX_LIST_INT: binary(RegOpcode::INDEX_LIST_INT); break;
+			case Opcode::LET:
+				materialize(h-1);
+				break;
+			case Opcode::POP: {
+				uint16_t amount = readUI16(operands);
+				stack.resize(h - amount);
+				if(capturesLocals) {
+					emit(RegOpcode::CLOSE);
+					writeUI16(out.codeOut, h - amount);
+				}
+				break;
+			} case Opcode::SET_LOCAL: {
+				int16_t idx = readI16(operands);
+				if(idx >= 0) {
+					setLocal(idx);
+				} else {
+					uint16_t b = rk(pop(), h-1);
+					emit(RegOpcode::SET_UPVALUE);
+					writeUI16(out.codeOut, -idx-1);
+					writeUI16(out.codeOut, b);
+				}
+				break;
+			} case Opcode::LOCAL: {
+				int16_t idx = readI16(operands);
+				if(idx >= 0) {
+					stack.push_back({ Operand::LOCAL, (uint16_t) idx });
+				} else {
+					emitDst(RegOpcode::GET_UPVALUE, h);
+					writeUI16(out.codeOut, -idx-1);
+					push(h);
+				}
+				break;
+			} case Opcode::GLOBAL:
+				emitDst(RegOpcode::GLOBAL, h);
+				writeUI16(out.codeOut, readUI16(operands));
+				push(h);
+				break;
+			case Opcode::JUMP:
+				materializeAll();
+				emit(RegOpcode::JUMP);
+				jump();
+				reachable = false;
+				break;
+			case Opcode::JUMP_IF_NOT: {
+				uint16_t b = rk(pop(), h-1);
+				materializeAll();
+				emit(RegOpcode::JUMP_IF_NOT);
+				writeUI16(out.codeOut, b);
+				jump();
+				break;
+			} case Opcode::JUMP_IF_NOT_LESS_INT:
+			case Opcode::JUMP_IF_NOT_LESS_OR_EQ_INT: {
+				Operand right = pop();
+				Operand left = pop();
+				uint16_t b = rk(left, h-2);
+				uint16_t c = rk(right, h-1);
+				materializeAll();
+				emit(op == Opcode::JUMP_IF_NOT_LESS_INT ? RegOpcode::JUMP_IF_NOT_LESS_INT : RegOpcode::JUMP_IF_NOT_LESS_OR_EQ_INT);
+				writeUI16(out.codeOut, b);
+				writeUI16(out.codeOut, c);
+				jump();
+				break;
+			} case Opcode::JUMP_IF_NOT_LESS_LOCAL_LOCAL:
+			case Opcode::JUMP_IF_NOT_LESS_LOCAL_CONSTANT: {
+				uint16_t b = readI16(operands);
+				uint16_t c = op == Opcode::JUMP_IF_NOT_LESS_LOCAL_LOCAL ? readI16(operands)
+					: rk({ Operand::CONST, readUI16(operands) }, h+1);
+				materializeAll();
+				emit(RegOpcode::JUMP_IF_NOT_LESS_INT);
+				writeUI16(out.codeOut, b);
+				writeUI16(out.codeOut, c);
+				jump();
+				break;
+			} case Opcode::LOCAL_LOCAL:
+				stack.push_back({ Operand::LOCAL, (uint16_t) readI16(operands) });
+				stack.push_back({ Operand::LOCAL, (uint16_t) readI16(operands) });
+				break;
+			case Opcode::LOCAL_CONSTANT:
+				stack.push_back({ Operand::LOCAL, (uint16_t) readI16(operands) });
+				stack.push_back({ Operand::CONST, readUI16(operands) });
+				break;
+			case Opcode::INC_LOCAL: {
+				uint16_t local = readI16(operands);
+				uint16_t c = rk({ Operand::CONST, readUI16(operands) }, h+1);
+				materializeLocal(local);
+				emit(RegOpcode::ADD_INT);
+				writeUI16(out.codeOut, local);
+				writeUI16(out.codeOut, local);
+				writeUI16(out.codeOut, c);
+				break;
+			} case Opcode::ADD_INT_SET_LOCAL:
+				binary(RegOpcode::ADD_INT);
+				setLocal(readI16(operands));
+				break;
+			case Opcode::CALL:
+			case Opcode::TAIL_CALL: {
+				uint16_t argCnt = readUI16(operands);
+				uint16_t base = h - 1 - argCnt;
+				materializeAll();
+				emit(op == Opcode::CALL ? RegOpcode::CALL : RegOpcode::TAIL_CALL);
+				writeUI16(out.codeOut, base);
+				writeUI16(out.codeOut, argCnt);
+				stack.resize(base);
+				push(base);
+				reachable = op == Opcode::CALL;
+				break;
+			} case Opcode::CALL_METHOD: {
+				uint16_t nsConstantIdx = readUI16(operands);
+				uint16_t nameConstantIdx = readUI16(operands);
+				uint16_t argCnt = readUI16(operands);
+				uint16_t base = h - 1 - argCnt;
+				materializeAll();
+				emit(RegOpcode::CALL_METHOD);
+				writeUI16(out.codeOut, base);
+				writeUI16(out.codeOut, nsConstantIdx);
+				writeUI16(out.codeOut, nameConstantIdx);
+				writeUI16(out.codeOut, argCnt);
+				stack.resize(base);
+				push(base);
+				break;
+			} case Opcode::RETURN: {
+				uint16_t b = rk(pop(), h-1);
+				emit(RegOpcode::RETURN);
+				writeUI16(out.codeOut, b);
+				reachable = false;
+				break;
+			} case Opcode::MAKE_FUNC: {
+				emit(RegOpcode::MAKE_FUNC);
+				writeUI16(out.codeOut, h);
+				writeUI16(out.codeOut, readUI16(operands)); // proto
+				writeUI16(out.codeOut, readUI16(operands)); // argCnt
+				uint16_t upvalueCnt = readUI16(operands);
+				writeUI16(out.codeOut, upvalueCnt);
+				for(uint16_t i = 0; i < upvalueCnt; i++) {
+					writeI16(out.codeOut, readI16(operands));
+				}
+				push(h);
+				break;
+			} case Opcode::MAKE_LIST: {
+				uint16_t valueCnt = readUI16(operands);
+				materializeAll();
+				emit(RegOpcode::MAKE_LIST);
+				writeUI16(out.codeOut, h - valueCnt);
+				writeUI16(out.codeOut, valueCnt);
+				stack.resize(h - valueCnt);
+				push(h - valueCnt);
+				break;
+			} case Opcode::MAKE_METHOD: {
+				uint16_t b = rk(pop(), h-1);
+				emit(RegOpcode::MAKE_METHOD);
+				writeUI16(out.codeOut, h-1);
+				writeUI16(out.codeOut, b);
+				writeUI16(out.codeOut, readUI16(operands));
+				writeUI16(out.codeOut, readUI16(operands));
+				push(h-1);
+				break;
+			} default:
+				throw std::runtime_error("Cannot translate " + opcodeDesc(op) + " to register code");
+			}
+		}
+		
+		// Implicit return
+		emit(RegOpcode::RETURN_NIL);
+		
+		for(auto& jump : jumps) {
+			auto operand = out.code.begin() + jump.first;
+			writeI16(operand, computeJump(jump.first + 2, newPos[jump.second]));
+		}
+	}
+
+private:
+	Chunk& chunk;
+	std::vector<int32_t>& heights;
+	FunctionChunk& out;
+	
+	std::vector<Operand> stack;
+	// Register written by the last instruction emitted, and the position of
+	// that operand, or -1 if it wrote no register that can be changed
+	int32_t lastDst = -1;
+	uint32_t lastDstPos;
+	
+	void emit(RegOpcode op) {
+		writeUI8(out.codeOut, (uint8_t) op);
+		lastDst = -1;
+	}
+	
+	void emitDst(RegOpcode op, uint16_t dst) {
+		emit(op);
+		lastDst = dst;
+		lastDstPos = out.code.size();
+		writeUI16(out.codeOut, dst);
+	}
+	
+	void push(uint16_t reg) {
+		stack.push_back({ Operand::REG, reg });
+	}
+	
+	Operand pop() {
+		Operand op = stack.back();
+		stack.pop_back();
+		return op;
+	}
+	
+	// Returns an RK operand for a value, loading it in 'scratch' if needed
+	uint16_t rk(Operand op, uint16_t scratch) {
+		if(op.kind == Operand::CONST) {
+			if(op.idx < RK_CONSTANT) return op.idx | RK_CONSTANT;
+			emit(RegOpcode::LOADK);
+			writeUI16(out.codeOut, scratch);
+			writeUI16(out.codeOut, op.idx);
+			return scratch;
+		}
+		return op.idx;
+	}
+	
+	void materialize(uint16_t slot) {
+		Operand& op = stack[slot];
+		if(op.kind == Operand::REG) return;
+		emitDst(op.kind == Operand::LOCAL ? RegOpcode::MOVE : RegOpcode::LOADK, slot);
+		writeUI16(out.codeOut, op.idx);
+		op = { Operand::REG, slot };
+	}
+	
+	void materializeAll() {
+		for(uint16_t slot = 0; slot < stack.size(); slot++) {
+			materialize(slot);
+		}
+	}
+	
+	// Copies values not yet read from a local before it is modified
+	void materializeLocal(uint16_t local) {
+		for(uint16_t slot = 0; slot < stack.size(); slot++) {
+			if(stack[slot].kind == Operand::LOCAL && stack[slot].idx == local)
+				materialize(slot);
+		}
+	}
+};
+
+}
+
+std::unique_ptr<Chunk> compileToRegisters(Chunk& chunk) {
+	std::vector<std::vector<int32_t>> heights = computeStackHeights(chunk);
+	std::unique_ptr<Chunk> res(new Chunk());
+	res->constants->vec = chunk.constants->vec;
+	res->isa = Isa::REGISTER;
+	res->verified = true;
+	for(uint32_t i = 0; i < chunk.functions.size(); i++) {
+		res->functions.emplace_back(new FunctionChunk());
+		RegisterTranslator(chunk, heights[i], *res->functions.back()).translate(*chunk.functions[i]);
+	}
+	return res;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+
+#include "chunk.hpp"
+
+// Register-based instruction set: operands name slots of the frame directly,
+// in Lua 5's three-address form. Registers are 16-bit offsets from the base of
+// the frame, the locals coming first. Operands marked RK may also be constants,
+// when their RK_CONSTANT bit is set. Jumps are relative to the end of the
+// instruction, and are always the last operand.
+enum class RegOpcode : uint8_t {
+	MOVE, // A RK
+	LOADK, // A constant
+	GET_UPVALUE, // A upvalue
+	SET_UPVALUE, // upvalue RK
+	GLOBAL, // A name
+	NEG, NOT, // A RK
+	// A RK RK
+	PLUS, MINUS, MULTIPLY, DIVIDE, MODULO, POWER,
+	OR, AND,
+	EQUALS, LESS, LESS_OR_EQ,
+	INDEX,
+	ADD_INT, SUB_INT, MUL_INT, MOD_INT,
+	ADD_REAL, SUB_REAL, MUL_REAL, DIV_REAL, MOD_REAL,
+	EQUALS_INT,
+	LESS_INT, LESS_OR_EQ_INT,
+	LESS_REAL, LESS_OR_EQ_REAL,
+	INDEX_LIST_INT,
+	JUMP, // jump
+	JUMP_IF_NOT, // RK jump
+	JUMP_IF_NOT_LESS_INT, JUMP_IF_NOT_LESS_OR_EQ_INT, // RK RK jump
+	// The arguments are in registers base..base+argCnt-1, the function in
+	// base+argCnt, and the result goes to base
+	CALL, TAIL_CALL, // base argCnt
+	CALL_METHOD, // base ns name argCnt (the receiver being in base)
+	RETURN, // RK
+	RETURN_NIL,
+	CLOSE, // A: closes upvalues pointing to registers A and up
+	MAKE_FUNC, // A proto argCnt upvalueCnt upvalues...
+	MAKE_LIST, // A count: from the values in A..A+count-1
+	MAKE_METHOD, // A RK ns name
+	// Linked by the VM before execution
+	GLOBAL_SLOT, // A slot
+	CALL_METHOD_SLOT, // base slot name argCnt
+	MAKE_METHOD_SLOT // A RK slot name
+};
+
+const uint16_t RK_CONSTANT = 0x8000;
+
+std::string regOpcodeDesc(RegOpcode opcode);
+
+void skipRegInstruction(std::vector<uint8_t>::iterator& it);
+
+// Translates the verified stack code of a chunk to register code, in a new
+// chunk sharing its constants. The stack slot of each temporary value is
+// known statically, and becomes its register; locals and constants are used
+// directly as operands when possible, instead of being copied first.
+std::unique_ptr<Chunk> compileToRegisters(Chunk& chunk);
+
+// Register code counterpart of Chunk::list, for one function
+std::string listRegisterCode(FunctionChunk& func);
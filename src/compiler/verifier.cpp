@@ -0,0 +1,358 @@
+#include "verifier.hpp"
+
+#include <string>
+#include <algorithm>
+
+VerifyError::VerifyError(const std::string& what)
+	: runtime_error("Verify error: " + what) { }
+
+namespace {
+
+// What MAKE_FUNC instructions tell us about a function prototype
+struct Prototype {
+	int32_t argCnt = -1; // -1 if never instantiated
+	int32_t upvalueCnt = -1;
+};
+
+// Stack height before an instruction, relative to the base of the frame
+struct StackState {
+	int32_t height = -1; // includes the locals; -1 if not reached yet
+	int32_t localCnt = 0;
+};
+
+class Verifier {
+public:
+	Verifier(Chunk& chunk) : chunk(chunk), protos(chunk.functions.size()) {}
+	
+	void verify() {
+		if(chunk.functions.empty()) throw VerifyError("Chunk has no main function");
+		protos[0] = { 0, 0 };
+		for(funcIdx = 0; funcIdx < chunk.functions.size(); funcIdx++) {
+			decodeFunction();
+		}
+		for(funcIdx = 0; funcIdx < chunk.functions.size(); funcIdx++) {
+			chunk.functions[funcIdx]->maxStack = checkStack();
+		}
+	}
+	
+	// Stack height before each instruction of each function, -1 if unreachable
+	std::vector<std::vector<int32_t>> heights;
+
+private:
+	Chunk& chunk;
+	std::vector<Prototype> protos;
+	std::vector<std::vector<bool>> instrStarts;
+	
+	uint32_t funcIdx;
+	uint32_t pos;
+	
+	[[noreturn]] void error(const std::string& msg) {
+		throw VerifyError(msg + " (function prototype " + std::to_string(funcIdx)
+			+ ", offset " + std::to_string(pos) + ")");
+	}
+	
+	void checkConstant(uint16_t idx) {
+		if(idx >= chunk.constants->vec.size()) error("Invalid constant index " + std::to_string(idx));
+	}
+	
+	void checkStringConstant(uint16_t idx) {
+		checkConstant(idx);
+		if(!chunk.constants->vec[idx].get<String>()) error("Expected string constant as operand");
+	}
+	
+	void checkIntConstant(uint16_t idx) {
+		checkConstant(idx);
+		if(!chunk.constants->vec[idx].isInt()) error("Expected int constant as operand");
+	}
+	
+	// First pass: find instruction boundaries, and check opcodes and operands
+	// which do not depend on the state of the stack
+	void decodeFunction() {
+		std::vector<uint8_t>& code = chunk.functions[funcIdx]->code;
+		instrStarts.emplace_back(code.size() + 1, false);
+		pos = 0;
+		while(pos < code.size()) {
+			instrStarts.back()[pos] = true;
+			auto it = code.begin() + pos;
+			auto end = code.end();
+			auto need = [&](uint32_t bytes) {
+				if((uint32_t) (end - it) < bytes) error("Truncated instruction");
+			};
+			Opcode op = (Opcode) readUI8(it);
+			switch(op) {
+			case Opcode::IGNORE: case Opcode::UNI_MINUS:
+			case Opcode::BIN_PLUS: case Opcode::BIN_MINUS: case Opcode::MULTIPLY: case Opcode::DIVIDE:
+			case Opcode::MODULO: case Opcode::POWER:
+			case Opcode::LET: case Opcode::NOT: case Opcode::OR: case Opcode::AND:
+			case Opcode::EQUALS: case Opcode::LESS: case Opcode::LESS_OR_EQ:
+			case Opcode::RETURN: case Opcode::INDEX:
+			case Opcode::ADD_INT: case Opcode::SUB_INT: case Opcode::MUL_INT: case Opcode::MOD_INT:
+			case Opcode::ADD_REAL: case Opcode::SUB_REAL: case Opcode::MUL_REAL: case Opcode::DIV_REAL:
+			case Opcode::MOD_REAL: case Opcode::EQUALS_INT:
+			case Opcode::LESS_INT: case Opcode::LESS_OR_EQ_INT:
+			case Opcode::LESS_REAL: case Opcode::LESS_OR_EQ_REAL:
+			case Opcode::INDEX_LIST_INT:
+				break;
+			case Opcode::POP: case Opcode::SET_LOCAL: case Opcode::LOCAL:
+			case Opcode::JUMP_IF_NOT: case Opcode::JUMP:
+			case Opcode::CALL: case Opcode::TAIL_CALL: case Opcode::MAKE_LIST:
+			case Opcode::ADD_INT_SET_LOCAL:
+			case Opcode::JUMP_IF_NOT_LESS_INT: case Opcode::JUMP_IF_NOT_LESS_OR_EQ_INT:
+				need(2);
+				break;
+			case Opcode::LOCAL_LOCAL:
+				need(4);
+				break;
+			case Opcode::LOCAL_CONSTANT:
+				need(4);
+				it += 2;
+				checkConstant(readUI16(it));
+				break;
+			case Opcode::INC_LOCAL:
+				need(4);
+				it += 2;
+				checkIntConstant(readUI16(it));
+				break;
+			case Opcode::JUMP_IF_NOT_LESS_LOCAL_LOCAL:
+				need(6);
+				break;
+			case Opcode::JUMP_IF_NOT_LESS_LOCAL_CONSTANT:
+				need(6);
+				it += 2;
+				checkIntConstant(readUI16(it));
+				break;
+			case Opcode::CONSTANT:
+				need(2);
+				checkConstant(readUI16(it));
+				break;
+			case Opcode::GLOBAL:
+				need(2);
+				checkStringConstant(readUI16(it));
+				break;
+			case Opcode::MAKE_METHOD:
+				need(4);
+				checkStringConstant(readUI16(it));
+				checkStringConstant(readUI16(it));
+				break;
+			case Opcode::CALL_METHOD:
+				need(6);
+				checkStringConstant(readUI16(it));
+				checkStringConstant(readUI16(it));
+				break;
+			case Opcode::MAKE_FUNC: {
+				need(6);
+				uint16_t protoIdx = readUI16(it);
+				uint16_t argCnt = readUI16(it);
+				uint16_t upvalueCnt = readUI16(it);
+				need(2*upvalueCnt);
+				if(protoIdx == 0 || protoIdx >= protos.size())
+					error("Invalid function prototype " + std::to_string(protoIdx));
+				Prototype& proto = protos[protoIdx];
+				if(proto.argCnt == -1) {
+					proto = { argCnt, upvalueCnt };
+				} else if(proto.argCnt != argCnt || proto.upvalueCnt != upvalueCnt) {
+					error("Inconsistent instantiations of function prototype " + std::to_string(protoIdx));
+				}
+				break;
+			} case Opcode::GLOBAL_SLOT: case Opcode::MAKE_METHOD_SLOT: case Opcode::CALL_METHOD_SLOT:
+				error("Unexpected linked instruction " + opcodeDesc(op));
+			default:
+				error("Unknown opcode " + std::to_string((int) op));
+			}
+			it = code.begin() + pos;
+			skipInstruction(it);
+			pos = it - code.begin();
+		}
+	}
+	
+	// Second pass: follow every path through the function, checking the stack
+	// height at each instruction. Returns the maximum stack depth.
+	uint32_t checkStack() {
+		std::vector<uint8_t>& code = chunk.functions[funcIdx]->code;
+		std::vector<bool>& starts = instrStarts[funcIdx];
+		// Prototypes which are never instantiated can't be executed, but are still checked
+		Prototype proto = protos[funcIdx].argCnt == -1 ? Prototype{0, 0} : protos[funcIdx];
+		
+		std::vector<StackState> states(code.size() + 1);
+		std::vector<uint32_t> worklist;
+		int32_t maxHeight = 1; // room for the return value
+		
+		auto reach = [&](uint32_t target, StackState state) {
+			if(target > code.size() || !starts[target] && target != code.size())
+				error("Invalid jump target " + std::to_string(target));
+			StackState& known = states[target];
+			if(known.height == -1) {
+				known = state;
+				maxHeight = std::max(maxHeight, state.height);
+				worklist.push_back(target);
+			} else if(known.height != state.height || known.localCnt != state.localCnt) {
+				error("Inconsistent stack height at offset " + std::to_string(target));
+			}
+		};
+		auto checkVariable = [&](int16_t idx, int32_t localCnt) {
+			if(idx >= 0 ? idx >= localCnt : -idx > proto.upvalueCnt)
+				error("Invalid local or upvalue index " + std::to_string(idx));
+		};
+		// Superinstructions only access locals
+		auto checkLocal = [&](int16_t idx, int32_t localCnt) {
+			if(idx < 0 || idx >= localCnt)
+				error("Invalid local index " + std::to_string(idx));
+		};
+		
+		pos = 0;
+		reach(0, { proto.argCnt, proto.argCnt });
+		while(!worklist.empty()) {
+			pos = worklist.back();
+			worklist.pop_back();
+			StackState state = states[pos];
+			int32_t temps = state.height - state.localCnt;
+			auto pops = [&](int32_t cnt) {
+				if(temps < cnt) error("Stack underflow");
+				state.height -= cnt;
+			};
+			
+			if(pos == code.size()) { // implicit return
+				if(temps != 0) error("Values left on stack at the end of function");
+				continue;
+			}
+			
+			auto it = code.begin() + pos;
+			Opcode op = (Opcode) readUI8(it);
+			bool fallsThrough = true;
+			switch(op) {
+			case Opcode::CONSTANT:
+			case Opcode::GLOBAL:
+				state.height++;
+				break;
+			case Opcode::IGNORE:
+				pops(1);
+				break;
+			case Opcode::UNI_MINUS: case Opcode::NOT: case Opcode::MAKE_METHOD:
+				pops(1);
+				state.height++;
+				break;
+			case Opcode::LET:
+				if(temps < 1) error("No value to bind to local");
+				state.localCnt++;
+				break;
+			case Opcode::POP: {
+				uint16_t amount = readUI16(it);
+				if(temps != 0) error("Values left on stack when popping locals");
+				if(amount > state.localCnt) error("Popping more locals than defined");
+				state.height -= amount;
+				state.localCnt -= amount;
+				break;
+			} case Opcode::SET_LOCAL:
+				checkVariable(readI16(it), state.localCnt);
+				pops(1);
+				break;
+			case Opcode::LOCAL:
+				checkVariable(readI16(it), state.localCnt);
+				state.height++;
+				break;
+			case Opcode::JUMP_IF_NOT: {
+				int16_t relJump = readI16(it);
+				pops(1);
+				reach((it - code.begin()) + relJump, state);
+				break;
+			} case Opcode::LOCAL_LOCAL:
+				checkLocal(readI16(it), state.localCnt);
+				checkLocal(readI16(it), state.localCnt);
+				state.height += 2;
+				break;
+			case Opcode::LOCAL_CONSTANT:
+				checkLocal(readI16(it), state.localCnt);
+				state.height += 2;
+				break;
+			case Opcode::INC_LOCAL:
+				checkLocal(readI16(it), state.localCnt);
+				break;
+			case Opcode::ADD_INT_SET_LOCAL:
+				checkLocal(readI16(it), state.localCnt);
+				pops(2);
+				break;
+			case Opcode::JUMP_IF_NOT_LESS_INT:
+			case Opcode::JUMP_IF_NOT_LESS_OR_EQ_INT: {
+				int16_t relJump = readI16(it);
+				pops(2);
+				reach((it - code.begin()) + relJump, state);
+				break;
+			} case Opcode::JUMP_IF_NOT_LESS_LOCAL_LOCAL:
+			case Opcode::JUMP_IF_NOT_LESS_LOCAL_CONSTANT: {
+				checkLocal(readI16(it), state.localCnt);
+				int16_t right = readI16(it);
+				if(op == Opcode::JUMP_IF_NOT_LESS_LOCAL_LOCAL)
+					checkLocal(right, state.localCnt);
+				int16_t relJump = readI16(it);
+				reach((it - code.begin()) + relJump, state);
+				break;
+			} case Opcode::JUMP: {
+				int16_t relJump = readI16(it);
+				reach((it - code.begin()) + relJump, state);
+				fallsThrough = false;
+				break;
+			} case Opcode::CALL:
+				pops(readUI16(it) + 1);
+				state.height++;
+				break;
+			case Opcode::CALL_METHOD:
+				it += 4;
+				pops(readUI16(it) + 1);
+				state.height++;
+				break;
+			case Opcode::TAIL_CALL: {
+				uint16_t argCnt = readUI16(it);
+				if(temps != argCnt + 1) error("Unexpected number of values on stack for tail call");
+				fallsThrough = false;
+				break;
+			} case Opcode::RETURN:
+				if(temps != 1) error("Unexpected number of values on stack for return");
+				fallsThrough = false;
+				break;
+			case Opcode::MAKE_FUNC: {
+				it += 4;
+				uint16_t upvalueCnt = readUI16(it);
+				for(uint16_t i = 0; i < upvalueCnt; i++) {
+					int16_t idx = readI16(it);
+					// A function can capture the slot it is about to be stored in
+					checkVariable(idx, state.localCnt + 1);
+				}
+				state.height++;
+				break;
+			} case Opcode::MAKE_LIST:
+				pops(readUI16(it));
+				state.height++;
+				break;
+			default: // binary operators
+				pops(2);
+				state.height++;
+				break;
+			}
+			
+			if(fallsThrough) {
+				it = code.begin() + pos;
+				skipInstruction(it);
+				reach(it - code.begin(), state);
+			}
+		}
+		
+		std::vector<int32_t>& funcHeights = heights.emplace_back();
+		for(StackState& state : states) {
+			funcHeights.push_back(state.height);
+		}
+		return maxHeight;
+	}
+};
+
+}
+
+void verifyChunk(Chunk& chunk) {
+	Verifier(chunk).verify();
+	chunk.verified = true;
+}
+
+std::vector<std::vector<int32_t>> computeStackHeights(Chunk& chunk) {
+	Verifier verifier(chunk);
+	verifier.verify();
+	return std::move(verifier.heights);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdexcept>
+
+#include "chunk.hpp"
+
+class VerifyError : public std::runtime_error {
+public:
+	VerifyError(const std::string& what);
+};
+
+// Checks that the bytecode of a chunk is well-formed: known opcodes, valid
+// operands and jump targets, and a stack height which is the same on every path
+// to an instruction and never goes below the locals. Records the maximum stack
+// depth of every function, and marks the chunk as verified.
+// The kinds of values are not checked: typed instructions check their operands.
+void verifyChunk(Chunk& chunk);
+
+// For each function of a valid chunk, the stack height (locals included) before
+// each instruction, indexed by code offset, or -1 for unreachable code.
+// The last entry is the height at the implicit return.
+std::vector<std::vector<int32_t>> computeStackHeights(Chunk& chunk);
@@ -3,11 +3,15 @@
 #include <cstdint>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "parser/ast.hpp"
 #include "parser/parser.hpp"
 #include "compiler/chunk.hpp"
 #include "compiler/compiler.hpp"
+#include "compiler/verifier.hpp"
+#include "compiler/aot.hpp"
+#include "compiler/registers.hpp"
 #include "vm/vm.hpp"
 
 bool parse(std::string inputPath, std::unique_ptr<Node>& program) {
@@ -33,6 +37,9 @@ bool compile(std::unique_ptr<Node> program, std::unique_ptr<Chunk>& chunk) {
 	} catch(CompileError& e) {
 		std::cout << e.what() << std::endl;
 		return false;
+	} catch(VerifyError& e) {
+		std::cout << e.what() << std::endl;
+		return false;
 	}
 	return true;
 }
@@ -44,12 +51,60 @@ bool loadBytecode(std::string inputPath, std::unique_ptr<Chunk>& chunk) {
 		return false;
 	}
 	
-	chunk = Chunk::loadFromFile(inputFile);
+	try {
+		chunk = Chunk::loadFromFile(inputFile);
+	} catch(VerifyError& e) {
+		std::cout << e.what() << std::endl;
+		return false;
+	}
 	return true;
 }
 
-bool run(std::unique_ptr<Chunk>& chunk) {
+struct Options {
+	bool jit = true;
+	uint32_t jitThreshold = JIT_THRESHOLD; // calls before a function gets compiled
+	bool registers = false; // translate to register code before listing or running
+	uint32_t gcSlice = 0; // objects marked or swept per GC step, 0 to mark all at once
+	uint32_t gcThreads = 1; // threads marking full collections
+	uint32_t maxHeap = 0; // in MiB, not counting the VM's own objects, 0 for no limit
+	bool gcStats = false; // written to stderr at exit
+};
+
+// Reads the number in an option of the form "--name=number". Invalid options
+// are left as arguments, so that the usage gets printed.
+bool readNumberOption(const std::string& arg, const std::string& name, uint32_t& value) {
+	if(arg.compare(0, name.size() + 1, name + "=") != 0) return false;
+	std::string number = arg.substr(name.size() + 1);
+	if(number.empty() || number.size() > 9 || number.find_first_not_of("0123456789") != std::string::npos)
+		return false;
+	value = std::stoul(number);
+	return true;
+}
+
+void selectIsa(std::unique_ptr<Chunk>& chunk, Options& options) {
+	if(options.registers)
+		chunk = compileToRegisters(*chunk);
+}
+
+// Scripts going past the heap limit fail like on any other execution error.
+// The message gives the limit rather than the live size, which depends on the
+// size of the VM's own objects.
+uint32_t heapLimitMiB = 0;
+
+void heapLimitExceeded(size_t heapBytes) {
+	throw ExecutionError("Heap limit of " + std::to_string(heapLimitMiB) + " MiB exceeded");
+}
+
+bool run(std::unique_ptr<Chunk>& chunk, Options& options) {
 	VM vm;
+	vm.setJitEnabled(options.jit);
+	vm.setJitThreshold(options.jitThreshold);
+	// The VM's stacks and globals, and the chunk, are left out of the limit
+	if(options.maxHeap != 0) {
+		heapLimitMiB = options.maxHeap;
+		GC::collect();
+		GC::setHeapLimit(GC::heapSize() + ((size_t) options.maxHeap << 20), heapLimitExceeded);
+	}
 	try {
 		vm.run(*chunk);
 	} catch(ExecutionError& e) {
@@ -59,7 +114,7 @@ bool run(std::unique_ptr<Chunk>& chunk) {
 	return true;
 }
 
-bool doOperation(std::string op, std::string inputPath) {
+bool doOperation(std::string op, std::string inputPath, Options& options) {
 	if(op == "parse") {
 		std::unique_ptr<Node> program;
 		if(!parse(inputPath, program)) return false;
@@ -79,21 +134,32 @@ bool doOperation(std::string op, std::string inputPath) {
 	} else if(op == "list") {
 		std::unique_ptr<Chunk> chunk;
 		if(!loadBytecode(inputPath, chunk)) return false;
+		selectIsa(chunk, options);
 		
 		std::cout << chunk->list() << std::endl;
+	} else if(op == "aot") {
+		std::unique_ptr<Chunk> chunk;
+		if(!loadBytecode(inputPath, chunk)) return false;
+		
+		std::cout << "Translating..." << std::endl;
+		std::string outputPath = inputPath.substr(0, inputPath.rfind('.')) + ".cpp";
+		std::ofstream outputFile(outputPath);
+		outputFile << translateToCpp(*chunk);
 	} else if(op == "run") {
 		std::unique_ptr<Chunk> chunk;
 		if(!loadBytecode(inputPath, chunk)) return false;
+		selectIsa(chunk, options);
 		
-		if(!run(chunk)) return false;
+		if(!run(chunk, options)) return false;
 	} else if(op == "interpret") {
 		std::unique_ptr<Node> program;
 		if(!parse(inputPath, program)) return false;
 		
 		std::unique_ptr<Chunk> chunk;
 		if(!compile(std::move(program), chunk)) return false;
+		selectIsa(chunk, options);
 		
-		if(!run(chunk)) return false;
+		if(!run(chunk, options)) return false;
 	} else {
 		std::cout << "Unknown operation: " << op << std::endl;
 		return false;
@@ -102,15 +168,47 @@ bool doOperation(std::string op, std::string inputPath) {
 }
 
 int main(int argc, char const *argv[]) {
-	if(argc != 3) {
-		std::cout << "\nUsage: somire parse|compile|list|run|interpret [filename]" << std::endl;
+	Options options;
+	std::vector<std::string> args;
+	for(int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if(arg == "--jit") {
+			options.jit = true;
+		} else if(arg == "--no-jit") {
+			options.jit = false;
+		} else if(arg == "--registers") {
+			options.registers = true;
+		} else if(arg == "--stack") {
+			options.registers = false;
+		} else if(arg == "--gc-stats") {
+			options.gcStats = true;
+		} else if(readNumberOption(arg, "--jit-threshold", options.jitThreshold)) {
+			continue;
+		} else if(readNumberOption(arg, "--gc-slice", options.gcSlice)) {
+			continue;
+		} else if(readNumberOption(arg, "--gc-threads", options.gcThreads)) {
+			continue;
+		} else if(readNumberOption(arg, "--max-heap", options.maxHeap)) {
+			continue;
+		} else {
+			args.push_back(arg);
+		}
+	}
+	
+	if(args.size() != 2) {
+		std::cout << "\nUsage: somire [--jit|--no-jit] [--jit-threshold=N] [--stack|--registers] [--gc-slice=N] [--gc-threads=N] [--max-heap=MiB] [--gc-stats] parse|compile|list|aot|run|interpret [filename]" << std::endl;
 		return 1;
 	}
 	
+	GC::setSliceBudget(options.gcSlice);
+	GC::setMarkThreads(options.gcThreads);
+	
 	int status = 0;
-	if(!doOperation(argv[1], argv[2]))
+	if(!doOperation(args[0], args[1], options))
 		status = 1;
 	
+	if(options.gcStats)
+		GC::writeStats(std::cerr);
 	GC::collect();
 	return status;
 }
@@ -63,7 +63,7 @@ class NodeExp : public Node {
 public:
 	using Node::Node;
 	
-	GC::Root<Type> valueType;
+	Type* valueType = nullptr; // kept alive by the handle scope of the compiler
 };
 
 class NodeId : public NodeExp {
@@ -0,0 +1,329 @@
+#include "arena.hpp"
+
+#include <new>
+#include <cstring>
+#include <vector>
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+#endif
+
+#include "gc.hpp"
+
+namespace GC {
+	namespace {
+		// Free slots are linked through their first word
+		struct FreeSlot {
+			FreeSlot* next;
+		};
+		
+		Page* pages[SIZE_CLASS_CNT + 1]; // the last list holds the large objects
+		// Emptied small pages, to be reused. A few are kept as they are, the next
+		// ones have their memory given back to the OS, and the rest are unmapped.
+		struct EmptyPages {
+			Page* first = nullptr;
+			uint32_t count = 0;
+		};
+		EmptyPages residentPages, discardedPages;
+		const uint32_t MAX_RESIDENT_PAGES = 16;
+		const uint32_t MAX_DISCARDED_PAGES = 256;
+		FreeSlot* freeLists[SIZE_CLASS_CNT];
+		std::vector<Page*> youngPages;
+		uint32_t liveObjects = 0;
+		size_t liveBytes = 0;
+		size_t youngBytes = 0;
+		
+		bool sweeping = false;
+		Page** sweepLinks[SIZE_CLASS_CNT + 1]; // links to the next page to sweep
+		uint32_t sweepClass; // swept by sweepSlice
+		
+		const size_t OS_PAGE_SIZE = 0x1000;
+		
+		size_t mappedSize(uint32_t sizeClass, size_t slotSize) {
+			if(sizeClass != LARGE_CLASS) return PAGE_SIZE;
+			return (PAGE_HEADER_SIZE + slotSize + OS_PAGE_SIZE - 1) / OS_PAGE_SIZE * OS_PAGE_SIZE;
+		}
+		
+		// Pages are mapped from the OS directly, so that their memory can be
+		// given back without unmapping them
+		Page* mapPage(size_t size) {
+		#ifdef _WIN32
+			// Allocations are aligned on 64 KiB, which is PAGE_SIZE
+			void* mem = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+			if(!mem) throw std::bad_alloc();
+			return (Page*) mem;
+		#else
+			// Mapped with some slack, trimmed to an aligned page
+			size_t slack = PAGE_SIZE - OS_PAGE_SIZE;
+			char* mem = (char*) mmap(nullptr, size + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if(mem == MAP_FAILED) throw std::bad_alloc();
+			char* start = (char*) (((uintptr_t) mem + PAGE_SIZE - 1) & ~(uintptr_t) (PAGE_SIZE - 1));
+			if(start != mem)
+				munmap(mem, start - mem);
+			if(start + size != mem + size + slack)
+				munmap(start + size, mem + slack - start);
+			return (Page*) start;
+		#endif
+		}
+		
+		void unmapPage(Page* page, size_t size) {
+		#ifdef _WIN32
+			VirtualFree(page, 0, MEM_RELEASE);
+		#else
+			munmap(page, size);
+		#endif
+		}
+		
+		// Gives the memory back to the OS, leaving it mapped: it reads as zeroes
+		// or as garbage when used again
+		void discard(void* mem, size_t size) {
+		#ifdef _WIN32
+			VirtualAlloc(mem, size, MEM_RESET, PAGE_READWRITE);
+		#else
+			madvise(mem, size, MADV_DONTNEED);
+		#endif
+		}
+		
+		void pushEmpty(EmptyPages& list, Page* page) {
+			page->next = list.first;
+			list.first = page;
+			list.count++;
+		}
+		
+		Page* popEmpty(EmptyPages& list) {
+			Page* page = list.first;
+			list.first = page->next;
+			list.count--;
+			return page;
+		}
+		
+		Page* newPage(uint32_t sizeClass, size_t slotSize, uint32_t slotCnt) {
+			Page* page;
+			if(sizeClass != LARGE_CLASS && residentPages.first) {
+				page = popEmpty(residentPages);
+			} else if(sizeClass != LARGE_CLASS && discardedPages.first) {
+				page = popEmpty(discardedPages);
+			} else {
+				page = mapPage(mappedSize(sizeClass, slotSize));
+			}
+			page->next = pages[sizeClass];
+			page->sizeClass = sizeClass;
+			page->slotSize = slotSize;
+			page->slotCnt = slotCnt;
+			page->allocatedCnt = 0;
+			page->young = false;
+			std::memset(page->allocated, 0, sizeof(page->allocated));
+			std::memset(page->marked, 0, sizeof(page->marked));
+			std::memset(page->remembered, 0, sizeof(page->remembered));
+			pages[sizeClass] = page;
+			// New pages need no sweeping
+			if(sweeping && sweepLinks[sizeClass] == &pages[sizeClass])
+				sweepLinks[sizeClass] = &page->next;
+			return page;
+		}
+		
+		void freePage(Page* page) {
+			if(page->sizeClass != LARGE_CLASS && residentPages.count < MAX_RESIDENT_PAGES) {
+				pushEmpty(residentPages, page);
+			} else if(page->sizeClass != LARGE_CLASS && discardedPages.count < MAX_DISCARDED_PAGES) {
+				discard(page, PAGE_SIZE);
+				pushEmpty(discardedPages, page);
+			} else {
+				unmapPage(page, mappedSize(page->sizeClass, page->slotSize));
+			}
+		}
+		
+		void pushFree(Page* page, uint32_t idx) {
+			FreeSlot* slot = (FreeSlot*) (page->slots() + idx * page->slotSize);
+			slot->next = freeLists[page->sizeClass];
+			freeLists[page->sizeClass] = slot;
+		}
+		
+		// Links the free slots of a page in front of its free list, in address order
+		void addFreeSlots(Page* page) {
+			for(uint32_t i = page->slotCnt; i-- > 0;) {
+				if(!(page->allocated[i / 64] & slotBit(i)))
+					pushFree(page, i);
+			}
+		}
+		
+		void setAllocated(void* ptr) {
+			Page* page = pageOf(ptr);
+			uint32_t idx = page->slotIdx(ptr);
+			page->allocated[idx / 64] |= slotBit(idx);
+			if(sweeping)
+				page->marked[idx / 64] |= slotBit(idx);
+			page->allocatedCnt++;
+			if(!page->young) {
+				page->young = true;
+				youngPages.push_back(page);
+			}
+			liveObjects++;
+			liveBytes += page->slotSize;
+			youngBytes += page->slotSize;
+		}
+		
+		// Destroys the unmarked objects of a page, calling 'freed' on their slots
+		template<typename F>
+		void sweepPage(Page* page, F freed) {
+			for(uint32_t w = 0; w < BITMAP_WORDS; w++) {
+				uint64_t dead = page->allocated[w] & ~page->marked[w];
+				uint32_t deadCnt = __builtin_popcountll(dead);
+				page->allocatedCnt -= deadCnt;
+				liveObjects -= deadCnt;
+				liveBytes -= deadCnt * page->slotSize;
+				page->allocated[w] &= page->marked[w];
+				while(dead) {
+					uint32_t idx = w * 64 + __builtin_ctzll(dead);
+					dead &= dead - 1;
+					GCObject* obj = (GCObject*) (page->slots() + idx * page->slotSize);
+					obj->~GCObject();
+					freed(idx);
+				}
+			}
+		}
+		
+		// Sweeps the next page of a size class, releasing it if emptied, or adding
+		// its free slots to the free list. Returns the work done, 0 if none was left.
+		uint32_t sweepNext(uint32_t sizeClass) {
+			Page* page = *sweepLinks[sizeClass];
+			if(!page) return 0;
+			uint32_t work = page->allocatedCnt + 1;
+			sweepPage(page, [](uint32_t) {});
+			if(page->allocatedCnt == 0) {
+				*sweepLinks[sizeClass] = page->next;
+				freePage(page);
+			} else {
+				if(sizeClass != LARGE_CLASS)
+					addFreeSlots(page);
+				sweepLinks[sizeClass] = &page->next;
+			}
+			return work;
+		}
+		
+		// All objects are old after a full sweep. Pages may have been released
+		// while listed as young, so their flags are cleared from the page lists.
+		void endSweep() {
+			for(uint32_t sizeClass = 0; sizeClass <= SIZE_CLASS_CNT; sizeClass++) {
+				for(Page* page = pages[sizeClass]; page; page = page->next) {
+					page->young = false;
+				}
+			}
+			youngPages.clear();
+			youngBytes = 0;
+			sweeping = false;
+		}
+	}
+	
+	void* allocate(size_t size) {
+		if(size > MAX_SMALL_SIZE) {
+			Page* page = newPage(LARGE_CLASS, size, 1);
+			setAllocated(page->slots());
+			return page->slots();
+		}
+		
+		uint32_t sizeClass = (size + SLOT_ALIGN - 1) / SLOT_ALIGN - 1;
+		FreeSlot* slot = freeLists[sizeClass];
+		// Pages left to sweep are reused before new ones are made
+		while(!slot && sweeping && sweepNext(sizeClass)) {
+			slot = freeLists[sizeClass];
+		}
+		if(!slot) {
+			size_t slotSize = (sizeClass + 1) * SLOT_ALIGN;
+			addFreeSlots(newPage(sizeClass, slotSize, (PAGE_SIZE - PAGE_HEADER_SIZE) / slotSize));
+			slot = freeLists[sizeClass];
+		}
+		freeLists[sizeClass] = slot->next;
+		setAllocated(slot);
+		return slot;
+	}
+	
+	void deallocate(void* ptr) {
+		Page* page = pageOf(ptr);
+		uint32_t idx = page->slotIdx(ptr);
+		page->allocated[idx / 64] &= ~slotBit(idx);
+		page->marked[idx / 64] &= ~slotBit(idx);
+		page->allocatedCnt--;
+		liveObjects--;
+		liveBytes -= page->slotSize;
+		// The page may be released by the next sweep
+		if(page->sizeClass != LARGE_CLASS)
+			pushFree(page, idx);
+	}
+	
+	void sweep() {
+		startSweep();
+		for(uint32_t sizeClass = 0; sizeClass <= SIZE_CLASS_CNT; sizeClass++) {
+			while(sweepNext(sizeClass));
+		}
+		endSweep();
+	}
+	
+	void startSweep() {
+		// The free lists are rebuilt from the pages as they are swept
+		for(uint32_t sizeClass = 0; sizeClass < SIZE_CLASS_CNT; sizeClass++) {
+			freeLists[sizeClass] = nullptr;
+		}
+		for(uint32_t sizeClass = 0; sizeClass <= SIZE_CLASS_CNT; sizeClass++) {
+			sweepLinks[sizeClass] = &pages[sizeClass];
+		}
+		sweepClass = 0;
+		sweeping = true;
+	}
+	
+	bool sweepSlice(uint32_t budget) {
+		uint32_t work = 0;
+		while(work < budget) {
+			uint32_t pageWork = sweepNext(sweepClass);
+			if(pageWork == 0 && ++sweepClass > SIZE_CLASS_CNT) {
+				endSweep();
+				return true;
+			}
+			work += pageWork;
+		}
+		return false;
+	}
+	
+	void sweepYoung() {
+		// Freed slots are added to the free lists as they are, emptied pages are
+		// left for the next full sweep to release
+		for(Page* page : youngPages) {
+			if(page->sizeClass == LARGE_CLASS) {
+				sweepPage(page, [](uint32_t) {});
+			} else {
+				sweepPage(page, [page](uint32_t idx) { pushFree(page, idx); });
+			}
+			page->young = false;
+		}
+		youngPages.clear();
+		youngBytes = 0;
+	}
+	
+	void clearMarks() {
+		for(uint32_t sizeClass = 0; sizeClass <= SIZE_CLASS_CNT; sizeClass++) {
+			for(Page* page = pages[sizeClass]; page; page = page->next) {
+				std::memset(page->marked, 0, sizeof(page->marked));
+			}
+		}
+	}
+	
+	void forEachObject(const std::function<void(GCObject*)>& f) {
+		for(uint32_t sizeClass = 0; sizeClass <= SIZE_CLASS_CNT; sizeClass++) {
+			for(Page* page = pages[sizeClass]; page; page = page->next) {
+				for(uint32_t w = 0; w < BITMAP_WORDS; w++) {
+					for(uint64_t bits = page->allocated[w]; bits; bits &= bits - 1) {
+						uint32_t idx = w * 64 + __builtin_ctzll(bits);
+						f((GCObject*) (page->slots() + idx * page->slotSize));
+					}
+				}
+			}
+		}
+	}
+	
+	uint32_t objectCount() { return liveObjects; }
+	size_t byteCount() { return liveBytes; }
+	size_t youngByteCount() { return youngBytes; }
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace GC {
+	class GCObject;
+	
+	// GC objects live in pages of PAGE_SIZE bytes, aligned on their size, so that
+	// the page of an object is found by masking its address. Small objects are
+	// segregated by size class, each page holding slots of a single size; larger
+	// objects get a page of their own, which may extend past PAGE_SIZE.
+	// The page header keeps bitmaps of the allocated, marked and remembered
+	// slots, so objects carry no GC state beyond their vtable.
+	const size_t PAGE_SIZE = 0x10000;
+	const size_t SLOT_ALIGN = 16;
+	const size_t MAX_SMALL_SIZE = 256;
+	const uint32_t SIZE_CLASS_CNT = MAX_SMALL_SIZE / SLOT_ALIGN;
+	const uint32_t LARGE_CLASS = SIZE_CLASS_CNT;
+	const uint32_t MAX_SLOTS = PAGE_SIZE / SLOT_ALIGN;
+	const uint32_t BITMAP_WORDS = MAX_SLOTS / 64;
+	
+	struct Page {
+		Page* next; // in the list of pages of the same size class
+		uint32_t sizeClass;
+		uint32_t slotSize;
+		uint32_t slotCnt;
+		uint32_t allocatedCnt;
+		bool young; // has objects allocated since the last collection
+		uint64_t allocated[BITMAP_WORDS];
+		uint64_t marked[BITMAP_WORDS];
+		uint64_t remembered[BITMAP_WORDS];
+		
+		char* slots();
+		inline uint32_t slotIdx(const void* obj) {
+			return ((const char*) obj - slots()) / slotSize;
+		}
+	};
+	
+	const size_t PAGE_HEADER_SIZE = (sizeof(Page) + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
+	
+	inline char* Page::slots() { return (char*) this + PAGE_HEADER_SIZE; }
+	
+	inline Page* pageOf(const void* obj) {
+		return (Page*) ((uintptr_t) obj & ~(uintptr_t) (PAGE_SIZE - 1));
+	}
+	
+	inline uint64_t slotBit(uint32_t idx) { return (uint64_t) 1 << (idx % 64); }
+	
+	// Pops a free slot of the size class of 'size'
+	void* allocate(size_t size);
+	// Frees the slot of an object without destroying it (for failed constructions)
+	void deallocate(void* ptr);
+	
+	// Objects stay marked once they survived a collection: they are then old.
+	// Both sweeps destroy the unmarked objects. A full sweep walks all the pages
+	// linearly, and gives the memory of the emptied ones back to the OS; a young
+	// sweep only walks the pages allocated in since the last collection.
+	void sweep();
+	void sweepYoung();
+	// Lazy full sweep: pages are swept by slices, or when allocation runs out of
+	// free slots in their size class, so that allocation only reuses swept
+	// pages. Objects allocated meanwhile are marked, as they are old once the
+	// sweep is done. Returns whether the sweep is done.
+	void startSweep();
+	bool sweepSlice(uint32_t budget);
+	// Unmarks all objects, before a full collection
+	void clearMarks();
+	
+	void forEachObject(const std::function<void(GCObject*)>& f);
+	
+	uint32_t objectCount();
+	// Bytes taken by the slots of the objects, large objects counting their
+	// actual size
+	size_t byteCount();
+	size_t youngByteCount(); // allocated since the last collection
+	
+	inline bool isMarked(const void* obj) {
+		Page* page = pageOf(obj);
+		uint32_t idx = page->slotIdx(obj);
+		return page->marked[idx / 64] & slotBit(idx);
+	}
+	// Returns whether the object was already marked
+	inline bool testAndMark(const void* obj) {
+		Page* page = pageOf(obj);
+		uint32_t idx = page->slotIdx(obj);
+		uint64_t& word = page->marked[idx / 64];
+		if(word & slotBit(idx)) return true;
+		word |= slotBit(idx);
+		return false;
+	}
+	// Same, for marking from several threads at once
+	inline bool testAndMarkAtomic(const void* obj) {
+		Page* page = pageOf(obj);
+		uint32_t idx = page->slotIdx(obj);
+		uint64_t* word = &page->marked[idx / 64];
+		if(__atomic_load_n(word, __ATOMIC_RELAXED) & slotBit(idx)) return true;
+		return __atomic_fetch_or(word, slotBit(idx), __ATOMIC_RELAXED) & slotBit(idx);
+	}
+	inline void unmark(const void* obj) {
+		Page* page = pageOf(obj);
+		uint32_t idx = page->slotIdx(obj);
+		page->marked[idx / 64] &= ~slotBit(idx);
+	}
+	
+	// Returns whether the object was already in the remembered set
+	inline bool testAndRemember(const void* obj) {
+		Page* page = pageOf(obj);
+		uint32_t idx = page->slotIdx(obj);
+		uint64_t& word = page->remembered[idx / 64];
+		if(word & slotBit(idx)) return true;
+		word |= slotBit(idx);
+		return false;
+	}
+	inline void forget(const void* obj) {
+		Page* page = pageOf(obj);
+		uint32_t idx = page->slotIdx(obj);
+		page->remembered[idx / 64] &= ~slotBit(idx);
+	}
+}
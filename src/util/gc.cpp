@@ -1,89 +1,707 @@
 #include "gc.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <typeinfo>
+#include <cxxabi.h>
+
 #ifdef DEBUG_GC
 #include <iostream>
 #endif
 
 namespace GC {
 	namespace {
-		std::unordered_set<GCObject*> objects;
-		std::unordered_map<GCObject*, int> rootObjects;
+		std::vector<GCObject*> rememberedSet;
+		// Objects marked by batches, with the index of their next child to mark
+		struct PartialScan {
+			GCObject* obj;
+			size_t from;
+		};
+		
+		// Marked objects, but with unmarked children. Those of partial scans are
+		// resumed once the gray objects from their last batch are scanned.
+		struct MarkStack {
+			std::vector<GCObject*> gray;
+			std::vector<PartialScan> partial;
+			size_t externalBytes = 0; // of the objects scanned
+			
+			bool empty() { return gray.empty() && partial.empty(); }
+			void clear() {
+				gray.clear();
+				partial.clear();
+			}
+		};
+		
+		MarkStack grayObjects;
+		// Where mark() pushes gray objects: the stack of the thread's marker
+		thread_local MarkStack* markStack = &grayObjects;
+		// When visiting, mark() pushes the objects without marking them, to find
+		// the children of an object
+		enum class MarkMode { SERIAL, PARALLEL, VISITING };
+		MarkMode markMode = MarkMode::SERIAL;
+		uint32_t markThreadCnt = 1;
+		
+		// Minor collections happen every NURSERY_SIZE bytes allocated, full ones
+		// when the heap doubled since the last one
+		const size_t NURSERY_SIZE = 0x40000;
+		size_t nextCollect = NURSERY_SIZE;
+		// Bytes left to allocate before step() has work to do
+		ptrdiff_t allocationBudget = NURSERY_SIZE;
+		
+		// External memory of the objects live at the end of the last full marking,
+		// plus what was reported since. Minor collections do not measure it.
+		size_t externalBytes = 0;
+		size_t youngExternalBytes = 0;
+		
+		size_t heapLimit = SIZE_MAX;
+		void (*heapLimitExceeded)(size_t heapBytes) = nullptr;
+		
+		enum class Phase { IDLE, MARKING, SWEEPING };
+		Phase phase = Phase::IDLE;
+		uint32_t sliceBudget = 0;
+		// Objects swept per step when collecting stop-the-world: only marking
+		// stops the world, the sweep being done lazily
+		const uint32_t LAZY_SWEEP_BUDGET = 256;
+		
+		// Pause times fall in buckets of powers of two microseconds
+		const uint32_t PAUSE_BUCKETS = 24;
+		struct PauseHistogram {
+			uint64_t buckets[PAUSE_BUCKETS] = {}; // pauses under 2^i us
+			uint64_t count = 0;
+			uint64_t totalNs = 0;
+			uint64_t maxNs = 0;
+			
+			void add(uint64_t ns) {
+				uint64_t us = ns / 1000;
+				uint32_t bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+				buckets[std::min(bucket, PAUSE_BUCKETS - 1)]++;
+				count++;
+				totalNs += ns;
+				maxNs = std::max(maxNs, ns);
+			}
+		};
+		
+		class PauseTimer {
+		public:
+			PauseTimer(PauseHistogram& histogram) : histogram(histogram), start(std::chrono::steady_clock::now()) {}
+			~PauseTimer() {
+				histogram.add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+			}
+		
+		private:
+			PauseHistogram& histogram;
+			std::chrono::steady_clock::time_point start;
+		};
+		
+		struct Stats {
+			uint64_t minorCollections = 0;
+			uint64_t fullCollections = 0;
+			PauseHistogram markPauses;
+			PauseHistogram sweepPauses;
+			uint64_t bytesAllocated = 0; // until the last scheduled step
+			size_t peakHeap = 0;
+		};
+		Stats stats;
+		ptrdiff_t scheduledBudget = NURSERY_SIZE; // allocation budget when scheduled
+		
+		void samplePeakHeap() {
+			stats.peakHeap = std::max(stats.peakHeap, heapSize());
+		}
+		
+		// Counts the objects which survived a collection by type: with sticky
+		// mark bits, those are the marked ones
+		std::vector<std::pair<const std::type_info*, uint32_t>> countSurvivors() {
+			std::vector<std::pair<const std::type_info*, uint32_t>> survivors;
+			size_t last = 0;
+			forEachObject([&](GCObject* obj) {
+				if(!GC::isMarked(obj)) return;
+				const std::type_info* type = &typeid(*obj);
+				if(last < survivors.size() && survivors[last].first == type) {
+					survivors[last].second++;
+					return;
+				}
+				for(last = 0; last < survivors.size(); last++) {
+					if(survivors[last].first == type) break;
+				}
+				if(last == survivors.size())
+					survivors.push_back({type, 0});
+				survivors[last].second++;
+			});
+			return survivors;
+		}
+		
+		std::string typeName(const std::type_info& type) {
+			int status;
+			char* demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+			if(!demangled) return type.name();
+			std::string name = demangled;
+			std::free(demangled);
+			return name;
+		}
+		
+		void writePauses(std::ostream& out, PauseHistogram& histogram) {
+			out << "{\"count\": " << histogram.count << ", \"totalUs\": " << histogram.totalNs / 1000
+				<< ", \"maxUs\": " << histogram.maxNs / 1000 << ", \"histogram\": {";
+			bool first = true;
+			for(uint32_t i = 0; i < PAUSE_BUCKETS; i++) {
+				if(histogram.buckets[i] == 0) continue;
+				out << (first ? "" : ", ") << "\"<" << ((uint64_t) 1 << i) << "us\": " << histogram.buckets[i];
+				first = false;
+			}
+			out << "}}";
+		}
+		
+		// Lists the objects referenced by 'obj', by having it mark them while
+		// visiting
+		std::vector<GCObject*> childrenOf(GCObject* obj) {
+			MarkStack stack;
+			MarkStack* prevStack = markStack;
+			MarkMode prevMode = markMode;
+			markStack = &stack;
+			markMode = MarkMode::VISITING;
+			obj->markChildren();
+			while(!stack.partial.empty()) {
+				PartialScan scan = stack.partial.back();
+				stack.partial.pop_back();
+				scan.obj->markChildrenFrom(scan.from);
+			}
+			markStack = prevStack;
+			markMode = prevMode;
+			return std::move(stack.gray);
+		}
+		
+		void logState() {
+			IF_DEBUG_GC(std::cout << "GC contains " << objectCount() << " objects (" << handles.size() << " handles)" << std::endl;)
+		}
+		
+		void forgetAll() {
+			for(GCObject* obj : rememberedSet) {
+				forget(obj);
+			}
+			rememberedSet.clear();
+		}
+		
+		inline void scanNext(MarkStack& stack) {
+			if(!stack.gray.empty()) {
+				GCObject* obj = stack.gray.back();
+				stack.gray.pop_back();
+				obj->markChildren();
+				stack.externalBytes += obj->externalSize();
+			} else {
+				PartialScan scan = stack.partial.back();
+				stack.partial.pop_back();
+				scan.obj->markChildrenFrom(scan.from);
+			}
+		}
+		
+		// Returns whether all gray objects were scanned
+		bool drain(uint32_t budget) {
+			for(uint32_t work = 0; work < budget; work++) {
+				if(grayObjects.empty()) return true;
+				scanNext(grayObjects);
+			}
+			return grayObjects.empty();
+		}
+		
+		// Each parallel marker scans its own stack of gray objects. When it grows,
+		// its oldest entries are moved to a shared list, from which idle markers
+		// steal half at a time.
+		struct Marker {
+			MarkStack stack;
+			std::mutex sharedLock;
+			std::vector<GCObject*> shared;
+			std::atomic<size_t> sharedCnt{0};
+		};
+		
+		const size_t SHARE_THRESHOLD = 64;
+		
+		void share(Marker& marker) {
+			std::vector<GCObject*>& gray = marker.stack.gray;
+			size_t cnt = gray.size() / 2;
+			std::lock_guard<std::mutex> guard(marker.sharedLock);
+			marker.shared.insert(marker.shared.end(), gray.begin(), gray.begin() + cnt);
+			gray.erase(gray.begin(), gray.begin() + cnt);
+			marker.sharedCnt.store(marker.shared.size(), std::memory_order_relaxed);
+		}
+		
+		// Moves half of the shared objects of 'victim' to the stack of 'thief'
+		bool steal(Marker& victim, Marker& thief) {
+			if(victim.sharedCnt.load(std::memory_order_relaxed) == 0) return false;
+			std::lock_guard<std::mutex> guard(victim.sharedLock);
+			size_t cnt = (victim.shared.size() + 1) / 2;
+			if(cnt == 0) return false;
+			thief.stack.gray.insert(thief.stack.gray.end(), victim.shared.end() - cnt, victim.shared.end());
+			victim.shared.resize(victim.shared.size() - cnt);
+			victim.sharedCnt.store(victim.shared.size(), std::memory_order_relaxed);
+			return true;
+		}
+		
+		bool stealAny(std::vector<Marker>& markers, uint32_t self) {
+			for(uint32_t i = 1; i <= markers.size(); i++) {
+				if(steal(markers[(self + i) % markers.size()], markers[self]))
+					return true;
+			}
+			return false;
+		}
+		
+		// A marker only goes idle with an empty shared list, and only markers
+		// which are not idle share: once all are idle, marking is done.
+		void runMarker(std::vector<Marker>& markers, uint32_t self, std::atomic<uint32_t>& idleCnt) {
+			Marker& marker = markers[self];
+			markStack = &marker.stack;
+			while(true) {
+				while(!marker.stack.empty()) {
+					scanNext(marker.stack);
+					if(marker.stack.gray.size() > SHARE_THRESHOLD && marker.sharedCnt.load(std::memory_order_relaxed) == 0)
+						share(marker);
+				}
+				if(stealAny(markers, self)) continue;
+				
+				idleCnt++;
+				while(true) {
+					if(idleCnt.load() == markers.size()) {
+						markStack = &grayObjects;
+						return;
+					}
+					bool workLeft = false;
+					for(Marker& other : markers) {
+						if(other.sharedCnt.load(std::memory_order_relaxed) != 0) workLeft = true;
+					}
+					if(workLeft) {
+						idleCnt--;
+						if(stealAny(markers, self)) break;
+						idleCnt++;
+					}
+					std::this_thread::yield();
+				}
+			}
+		}
+		
+		// Scans all gray objects, splitting them between the mark threads
+		void drainParallel() {
+			if(markThreadCnt <= 1 || grayObjects.empty()) {
+				drain(UINT32_MAX);
+				return;
+			}
+			
+			std::vector<Marker> markers(markThreadCnt);
+			for(size_t i = 0; i < grayObjects.gray.size(); i++) {
+				markers[i % markThreadCnt].stack.gray.push_back(grayObjects.gray[i]);
+			}
+			for(size_t i = 0; i < grayObjects.partial.size(); i++) {
+				markers[i % markThreadCnt].stack.partial.push_back(grayObjects.partial[i]);
+			}
+			grayObjects.clear();
+			
+			markMode = MarkMode::PARALLEL;
+			std::atomic<uint32_t> idleCnt{0};
+			std::vector<std::thread> threads;
+			for(uint32_t i = 1; i < markThreadCnt; i++) {
+				threads.emplace_back(runMarker, std::ref(markers), i, std::ref(idleCnt));
+			}
+			runMarker(markers, 0, idleCnt);
+			for(std::thread& thread : threads) {
+				thread.join();
+			}
+			for(Marker& marker : markers) {
+				grayObjects.externalBytes += marker.stack.externalBytes;
+			}
+			markMode = MarkMode::SERIAL;
+		}
+		
+		// Old roots are marked already, so their children are marked as well
+		void markRoot(GCObject* obj) {
+			obj->mark();
+			obj->markChildren();
+		}
+		
+		template<typename F>
+		void forEachRoot(F f) {
+			RootBase::forEach(f);
+			for(GCObject* obj : handles) {
+				if(obj) f(obj);
+			}
+		}
+		
+		// Roots are not behind the write barrier, so they are scanned again at
+		// the end of marking
+		void markRoots() {
+			forEachRoot(markRoot);
+		}
+		
+		// Rescans the marked objects written to
+		void markRemembered() {
+			for(GCObject* obj : rememberedSet) {
+				obj->markChildren();
+			}
+			forgetAll();
+		}
 		
-		uint32_t nextCollect = 16;
+		// Marks all live objects at once. Any cycle in progress is restarted
+		// from scratch.
+		void markAll() {
+			grayObjects.clear();
+			grayObjects.externalBytes = 0;
+			clearMarks();
+			forgetAll();
+			markRoots();
+			drainParallel();
+			externalBytes = grayObjects.externalBytes;
+			youngExternalBytes = 0;
+		}
 		
-		void add(GCObject* obj) {
-			objects.insert(obj);
+		void startCycle() {
+			IF_DEBUG_GC(std::cout << "Starting collection cycle..." << std::endl;)
+			grayObjects.externalBytes = 0;
+			clearMarks();
+			forgetAll();
+			markRoots();
+			phase = Phase::MARKING;
 		}
+		
+		void finishMarking() {
+			markRoots();
+			drainParallel();
+			externalBytes = grayObjects.externalBytes;
+			youngExternalBytes = 0;
+			startSweep();
+			phase = Phase::SWEEPING;
+		}
+		
+		void finishCycle() {
+			stats.fullCollections++;
+			forgetAll();
+			nextCollect = std::max(heapSize() * 2, NURSERY_SIZE);
+			phase = Phase::IDLE;
+			IF_DEBUG_GC(std::cout << "Done collecting." << std::endl;)
+			logState();
+		}
+		
+		// A cycle in progress advances at every step, otherwise the allocation
+		// budget lasts until the nursery is full or the heap limit is reached
+		void scheduleStep() {
+			size_t young = youngByteCount() + youngExternalBytes;
+			size_t budget = young < NURSERY_SIZE ? NURSERY_SIZE - young : 0;
+			size_t heap = heapSize();
+			budget = std::min(budget, heap < heapLimit ? heapLimit - heap : 0);
+			stats.bytesAllocated += scheduledBudget - allocationBudget;
+			allocationBudget = std::min(budget, (size_t) PTRDIFF_MAX);
+			scheduledBudget = allocationBudget;
+			stepPending = phase != Phase::IDLE || budget == 0;
+		}
+	}
+	
+	bool stepPending = false;
+	
+	std::vector<GCObject*> handles;
+	
+	HandleScope::HandleScope() : base(handles.size()) {}
+	
+	HandleScope::~HandleScope() {
+		handles.resize(base);
+	}
+	
+	RootBase* RootBase::first = nullptr;
+	
+	RootBase::RootBase(GCObject* obj) : obj(obj), prev(nullptr), next(first) {
+		if(first) first->prev = this;
+		first = this;
+	}
+	
+	RootBase::~RootBase() {
+		if(prev) prev->next = next;
+		else first = next;
+		if(next) next->prev = prev;
+	}
+	
+	void setSliceBudget(uint32_t budget) {
+		sliceBudget = budget;
+	}
+	
+	void setMarkThreads(uint32_t count) {
+		markThreadCnt = std::max(count, 1u);
 	}
 	
-	void pin(GCObject* obj) {
-		IF_DEBUG_GC(std::cout << "Pinning " << obj << std::endl;)
-		if(rootObjects.find(obj) == rootObjects.end())
-			rootObjects[obj] = 0;
-		rootObjects[obj]++;
+	void setHeapLimit(size_t maxBytes, void (*exceeded)(size_t heapBytes)) {
+		heapLimit = maxBytes;
+		heapLimitExceeded = exceeded;
+		scheduleStep();
 	}
 	
-	void unpin(GCObject* obj) {
-		IF_DEBUG_GC(std::cout << "Unpinning " << obj << std::endl;)
-		if(--rootObjects[obj] <= 0)
-			rootObjects.erase(obj);
+	void allocateExternal(size_t bytes) {
+		externalBytes += bytes;
+		youngExternalBytes += bytes;
+		allocationBudget -= bytes;
+		if(allocationBudget < 0) stepPending = true;
 	}
 	
-	void logState() {
-		IF_DEBUG_GC(std::cout << "GC contains " << objects.size() << " objects (" << rootObjects.size() << " roots)" << std::endl;)
+	size_t heapSize() {
+		return byteCount() + externalBytes;
+	}
+	
+	void writeBarrierSlow(GCObject* obj, GCObject* child) {
+		if(phase == Phase::MARKING) {
+			child->mark();
+		} else if(!testAndRemember(obj)) {
+			rememberedSet.push_back(obj);
+		}
 	}
 	
 	void collect() {
 		IF_DEBUG_GC(std::cout << "Collecting..." << std::endl;)
-		
-		for(auto pair : rootObjects) {
-			pair.first->mark();
+		samplePeakHeap();
+		{
+			PauseTimer timer(stats.markPauses);
+			markAll();
 		}
+		{
+			PauseTimer timer(stats.sweepPauses);
+			sweep();
+		}
+		finishCycle();
+		scheduleStep();
+	}
+	
+	void collectMinor() {
+		IF_DEBUG_GC(std::cout << "Collecting young objects..." << std::endl;)
 		
-		auto it = objects.begin();
-		while(it != objects.end()) {
-			GCObject* obj = *it;
-			if(obj->isMarked()) {
-				obj->reset();
-				++it;
-			} else {
-				it = objects.erase(it);
-				delete obj;
-			}
+		// Marking stops at old objects, which are still marked: the young objects
+		// referenced by them are found from the roots and the remembered set
+		{
+			PauseTimer timer(stats.markPauses);
+			markRoots();
+			markRemembered();
+			drain(UINT32_MAX);
+		}
+		{
+			PauseTimer timer(stats.sweepPauses);
+			sweepYoung();
 		}
+		youngExternalBytes = 0;
+		stats.minorCollections++;
 		
 		IF_DEBUG_GC(std::cout << "Done collecting." << std::endl;)
 		logState();
+		scheduleStep();
 	}
 	
-	void step() {
-		if(objects.size() >= nextCollect) {
-			GC::collect();
-			nextCollect = objects.size() * 2;
+	void stepSlow() {
+		samplePeakHeap();
+		if(heapSize() >= heapLimit) {
+			// Any cycle in progress is finished at once
+			collect();
+			if(heapSize() >= heapLimit && heapLimitExceeded)
+				heapLimitExceeded(heapSize());
+			return;
 		}
+		
+		switch(phase) {
+		case Phase::IDLE:
+			if(youngByteCount() + youngExternalBytes < NURSERY_SIZE) break;
+			if(heapSize() < nextCollect) {
+				collectMinor();
+			} else if(sliceBudget == 0) {
+				IF_DEBUG_GC(std::cout << "Collecting..." << std::endl;)
+				PauseTimer timer(stats.markPauses);
+				markAll();
+				startSweep();
+				phase = Phase::SWEEPING;
+			} else {
+				PauseTimer timer(stats.markPauses);
+				startCycle();
+			}
+			break;
+		case Phase::MARKING: {
+			PauseTimer timer(stats.markPauses);
+			if(drain(sliceBudget))
+				finishMarking();
+			break;
+		} case Phase::SWEEPING: {
+			PauseTimer timer(stats.sweepPauses);
+			if(sweepSlice(sliceBudget != 0 ? sliceBudget : LAZY_SWEEP_BUDGET))
+				finishCycle();
+			break;
+		}
+		}
+		scheduleStep();
 	}
 	
-	GCObject::GCObject() : _marked(false) {
+	void writeStats(std::ostream& out) {
+		samplePeakHeap();
+		out << "{\"collections\": {\"minor\": " << stats.minorCollections << ", \"full\": " << stats.fullCollections << "},\n";
+		out << "\"markPauses\": ";
+		writePauses(out, stats.markPauses);
+		out << ",\n\"sweepPauses\": ";
+		writePauses(out, stats.sweepPauses);
+		out << ",\n\"bytesAllocated\": " << stats.bytesAllocated + (scheduledBudget - allocationBudget);
+		out << ",\n\"heapBytes\": " << heapSize();
+		out << ",\n\"peakHeapBytes\": " << stats.peakHeap;
+		out << ",\n\"survivors\": {";
+		auto survivors = countSurvivors();
+		for(size_t i = 0; i < survivors.size(); i++) {
+			out << (i == 0 ? "" : ", ") << "\"" << typeName(*survivors[i].first) << "\": " << survivors[i].second;
+		}
+		out << "}}\n";
+	}
+	
+	void dumpHeap(std::ostream& out) {
+		// Objects are numbered from 1 in the order they are found, 0 standing
+		// for a node referencing all roots
+		std::unordered_map<GCObject*, uint32_t> ids;
+		std::vector<GCObject*> objects = {nullptr};
+		std::vector<std::vector<uint32_t>> refs(1);
+		auto idOf = [&](GCObject* obj) {
+			auto it = ids.find(obj);
+			if(it != ids.end()) return it->second;
+			uint32_t id = objects.size();
+			ids[obj] = id;
+			objects.push_back(obj);
+			refs.emplace_back();
+			return id;
+		};
+		forEachRoot([&](GCObject* obj) {
+			uint32_t id = idOf(obj);
+			refs[0].push_back(id);
+		});
+		for(uint32_t id = 1; id < objects.size(); id++) {
+			for(GCObject* child : childrenOf(objects[id])) {
+				uint32_t childId = idOf(child);
+				refs[id].push_back(childId);
+			}
+		}
+		
+		// Immediate dominators, by the iterative algorithm of Cooper, Harvey and
+		// Kennedy, over a depth-first postorder
+		uint32_t cnt = objects.size();
+		std::vector<uint32_t> postorder, postIdx(cnt);
+		std::vector<bool> visited(cnt);
+		std::vector<std::pair<uint32_t, size_t>> dfs = {{0, 0}};
+		visited[0] = true;
+		while(!dfs.empty()) {
+			auto& top = dfs.back();
+			if(top.second < refs[top.first].size()) {
+				uint32_t next = refs[top.first][top.second++];
+				if(!visited[next]) {
+					visited[next] = true;
+					dfs.push_back({next, 0});
+				}
+			} else {
+				postIdx[top.first] = postorder.size();
+				postorder.push_back(top.first);
+				dfs.pop_back();
+			}
+		}
+		std::vector<std::vector<uint32_t>> preds(cnt);
+		for(uint32_t id = 0; id < cnt; id++) {
+			for(uint32_t child : refs[id]) {
+				preds[child].push_back(id);
+			}
+		}
+		const uint32_t NONE = UINT32_MAX;
+		std::vector<uint32_t> idom(cnt, NONE);
+		idom[0] = 0;
+		bool changed = true;
+		while(changed) {
+			changed = false;
+			for(size_t i = cnt - 1; i-- > 0;) { // reverse postorder, skipping the root
+				uint32_t id = postorder[i];
+				uint32_t dom = NONE;
+				for(uint32_t pred : preds[id]) {
+					if(idom[pred] == NONE) continue;
+					if(dom == NONE) {
+						dom = pred;
+						continue;
+					}
+					uint32_t other = pred;
+					while(dom != other) {
+						while(postIdx[dom] < postIdx[other]) dom = idom[dom];
+						while(postIdx[other] < postIdx[dom]) other = idom[other];
+					}
+				}
+				if(idom[id] != dom) {
+					idom[id] = dom;
+					changed = true;
+				}
+			}
+		}
+		
+		// Dominated objects come first in postorder
+		std::vector<size_t> sizes(cnt), retained(cnt);
+		for(uint32_t id = 1; id < cnt; id++) {
+			sizes[id] = pageOf(objects[id])->slotSize + objects[id]->externalSize();
+		}
+		for(uint32_t id : postorder) {
+			retained[id] += sizes[id];
+			if(id != 0) retained[idom[id]] += retained[id];
+		}
+		
+		std::unordered_map<const std::type_info*, std::string> typeNames;
+		out << "{\"roots\": [";
+		for(size_t i = 0; i < refs[0].size(); i++) {
+			out << (i == 0 ? "" : ", ") << refs[0][i];
+		}
+		out << "],\n\"objects\": [";
+		auto typeNameOf = [&](GCObject* obj) -> std::string& {
+			const std::type_info* type = &typeid(*obj);
+			auto it = typeNames.find(type);
+			if(it == typeNames.end())
+				it = typeNames.emplace(type, typeName(*type)).first;
+			return it->second;
+		};
+		for(uint32_t id = 1; id < cnt; id++) {
+			out << (id == 1 ? "\n" : ",\n") << "{\"id\": " << id << ", \"type\": \"" << typeNameOf(objects[id])
+				<< "\", \"size\": " << sizes[id] << ", \"retained\": " << retained[id] << ", \"refs\": [";
+			for(size_t i = 0; i < refs[id].size(); i++) {
+				out << (i == 0 ? "" : ", ") << refs[id][i];
+			}
+			out << "]}";
+		}
+		out << "\n]}\n";
+	}
+	
+	GCObject::GCObject() {
 		IF_DEBUG_GC(std::cout << "Created GCObject " << this << std::endl;)
-		add(this);
 	}
 	
 	GCObject::~GCObject() {
 		IF_DEBUG_GC(std::cout << "Deleted GCObject " << this << std::endl;)
 	}
 	
+	void* GCObject::operator new(size_t size) {
+		allocationBudget -= size;
+		if(allocationBudget < 0) stepPending = true;
+		return allocate(size);
+	}
+	
+	void GCObject::operator delete(void* ptr) {
+		deallocate(ptr);
+	}
+	
 	void GCObject::mark() {
-		if(!_marked) {
-			_marked = true;
-			markChildren();
+		if(markMode == MarkMode::SERIAL ? !testAndMark(this) : markMode == MarkMode::VISITING || !testAndMarkAtomic(this)) {
+			// The object is read when scanned, which is soon for the top of the stack
+			__builtin_prefetch(this);
+			markStack->gray.push_back(this);
 		}
 	}
 	
 	void GCObject::reset() {
-		_marked = false;
+		unmark(this);
 	}
 	
-	bool GCObject::isMarked() { return _marked; }
+	bool GCObject::isMarked() { return GC::isMarked(this); }
 	
 	void GCObject::markChildren() {}
+	
+	void GCObject::markChildrenFrom(size_t from) {}
+	
+	size_t GCObject::externalSize() { return 0; }
+	
+	void markLater(GCObject* obj, size_t from) {
+		markStack->partial.push_back({obj, from});
+	}
 }
@@ -1,8 +1,10 @@
 #pragma once
 
-#include <unordered_set>
 #include <unordered_map>
 #include <vector>
+#include <ostream>
+
+#include "arena.hpp"
 
 #ifdef DEBUG_GC
 #define IF_DEBUG_GC(x) x
@@ -13,11 +15,53 @@
 namespace GC {
 	class GCObject;
 	
-	void pin(GCObject* obj);
-	void unpin(GCObject* obj);	
-	
+	// Collections are generational: objects which survived one are old, and a
+	// minor collection only frees young objects. The old objects referencing
+	// young ones are remembered by the write barrier, and the roots are always
+	// scanned.
+	// Full collections from step() sweep lazily, by slices and as allocation
+	// needs free slots. With a slice budget, marking is incremental too: step()
+	// then marks or sweeps about 'budget' objects at a time. While marking, the
+	// write barrier marks the objects stored in marked ones, and the roots are
+	// scanned once more at the end.
+	// Collections are triggered by the bytes allocated, but only run from
+	// step(), which is called at safepoints: where all live objects are
+	// reachable from the roots.
 	void collect();
-	void step();
+	void collectMinor();
+	extern bool stepPending;
+	void stepSlow();
+	inline void step() {
+		if(stepPending) stepSlow();
+	}
+	void setSliceBudget(uint32_t budget); // 0 for stop-the-world marking
+	// Stop-the-world full marking is split between 'count' threads
+	void setMarkThreads(uint32_t count);
+	// Once the heap grows past 'maxBytes', step() collects it fully, and calls
+	// 'exceeded' with its size if that was not enough. The handler may throw.
+	void setHeapLimit(size_t maxBytes, void (*exceeded)(size_t heapBytes));
+	
+	// Telemetry since the start of the process, written as JSON: collection
+	// counts, histograms of the mark and sweep pauses, bytes allocated, peak
+	// heap, and the number of objects of each type which survived a collection
+	void writeStats(std::ostream& out);
+	// Writes the graph of the objects reachable from the roots as JSON, with
+	// the bytes each object retains: those only reachable through it
+	void dumpHeap(std::ostream& out);
+	
+	// Objects report the memory they own outside of the GC arena when they
+	// allocate or grow it. It is measured again from the live objects by full
+	// collections.
+	void allocateExternal(size_t bytes);
+	size_t heapSize(); // in bytes, including external memory
+	
+	void writeBarrierSlow(GCObject* obj, GCObject* child);
+	// To be called when storing a reference to 'child' in 'obj'
+	inline void writeBarrier(GCObject* obj, GCObject* child) {
+		if(isMarked(obj) && !isMarked(child)) writeBarrierSlow(obj, child);
+	}
+	
+	const size_t MARK_BATCH = 128;
 	
 	class GCObject {
 	public:
@@ -25,19 +69,70 @@ namespace GC {
 		GCObject(GCObject const&) = delete;
 		virtual ~GCObject();
 		
+		// Objects are allocated in the GC arena, which owns them
+		static void* operator new(size_t size);
+		static void operator delete(void* ptr);
+		
 		void mark();
 		void reset();
 		bool isMarked();
+		
+		virtual void markChildren();
+		// Resumes marking the children deferred with markLater()
+		virtual void markChildrenFrom(size_t from);
+		// Bytes owned outside of the object's slot
+		virtual size_t externalSize();
+	};
+	
+	// Objects with many children mark them by batches of MARK_BATCH, deferring
+	// the rest from index 'from' on, so that no single mark step scans them all
+	void markLater(GCObject* obj, size_t from);
+	
+	// Roots for C++ code with a stack discipline: objects passed to handle() stay
+	// alive until the innermost open HandleScope is closed. Handles are kept in
+	// a contiguous array, which a scope truncates when closed.
+	extern std::vector<GCObject*> handles;
+	
+	class HandleScope {
+	public:
+		HandleScope();
+		HandleScope(HandleScope const&) = delete;
+		~HandleScope();
 	
+	private:
+		size_t base;
+	};
+	
+	template<typename T>
+	inline T* handle(T* obj) {
+		handles.push_back(obj);
+		return obj;
+	}
+	
+	// Roots with any lifetime are linked in a list, so that making one takes a
+	// few pointer stores
+	class RootBase {
+	public:
+		RootBase(RootBase const&) = delete;
+		
+		template<typename F>
+		static void forEach(F f);
+		
 	protected:
-		virtual void markChildren();
+		RootBase(GCObject* obj);
+		~RootBase();
 		
+		GCObject* obj;
+	
 	private:
-		bool _marked;
+		RootBase* prev;
+		RootBase* next;
+		
+		static RootBase* first;
 	};
 	
 	template<typename T>
-	class Root {
+	class Root : public RootBase {
 	public:
 		Root();
 		Root(T* obj);
@@ -54,9 +149,6 @@ namespace GC {
 		Root<T>& operator=(Root<T>&&);
 		
 		void swap(Root<T>& other);
-		
-	private:
-		T* obj;
 	};
 }
 
@@ -1,50 +1,47 @@
 #pragma once
 
 namespace GC {
+	template<typename F>
+	void RootBase::forEach(F f) {
+		for(RootBase* root = first; root; root = root->next) {
+			if(root->obj) f(root->obj);
+		}
+	}
+	
 	template<typename T>
-	Root<T>::Root() : obj(nullptr) {}
+	Root<T>::Root() : RootBase(nullptr) {}
 	
 	template<typename T>
-	Root<T>::Root(T* obj) : obj(obj) {
-		pin(obj);
-	}
+	Root<T>::Root(T* obj) : RootBase(obj) {}
 	
 	template<typename T>
-	Root<T>::Root(Root<T>&& other) : obj(nullptr) {
-		swap(other);
+	Root<T>::Root(Root<T>&& other) : RootBase(other.obj) {
+		other.obj = nullptr;
 	}
 	
 	template<typename T>
-	Root<T>::~Root() {
-		if(obj) unpin(obj);
-	}
+	Root<T>::~Root() {}
 	
 	template<typename T>
-	T* Root<T>::get() { return obj; }
+	T* Root<T>::get() { return static_cast<T*>(obj); }
 	template<typename T>
 	T* Root<T>::release() {
-		T* temp = obj;
-		if(obj) {
-			unpin(obj);
-			obj = nullptr;
-		}
+		T* temp = get();
+		obj = nullptr;
 		return temp;
 	}
 	template<typename T>
 	void Root<T>::reset(T* obj2) {
-		if(obj) unpin(obj);
 		obj = obj2;
-		if(obj) pin(obj);
 	}
 	
 	template<typename T>
-	T& Root<T>::operator*() { return *obj; }
+	T& Root<T>::operator*() { return *get(); }
 	template<typename T>
-	T* Root<T>::operator->() { return obj; }
+	T* Root<T>::operator->() { return get(); }
 	
 	template<typename T>
 	Root<T>& Root<T>::operator=(Root<T>&& other) {
-		if(obj) unpin(obj);
 		obj = other.obj;
 		other.obj = nullptr;
 		return *this;
@@ -52,7 +49,7 @@ namespace GC {
 	
 	template<typename T>
 	void Root<T>::swap(Root<T>& other) {
-		T* temp = other.obj;
+		GCObject* temp = other.obj;
 		other.obj = obj;
 		obj = temp;
 	}
@@ -0,0 +1,136 @@
+#include "aot_runtime.hpp"
+
+#include <iostream>
+#include <algorithm>
+
+AotRuntime::AotRuntime(std::vector<AotFunction> protos) : constants(new List()), protos(std::move(protos)),
+		globals(new Namespace()), stack(new Stack()), calls(new CallStack()), tailCallee(nullptr) {
+	loadStd(*globals);
+}
+
+int AotRuntime::run() {
+	try {
+		calls->push(0, 0, nullptr);
+		execute(0, nullptr, stack->begin());
+		calls->pop();
+	} catch(ExecutionError& e) {
+		std::cout << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+// Runs a function in the current frame, then the functions it tail calls
+Value AotRuntime::execute(uint16_t protoIdx, Function* func, Value* fp) {
+	Value res = protos[protoIdx](*this, func, fp);
+	while(tailCallee) {
+		func = tailCallee;
+		tailCallee = nullptr;
+		calls->back().func = func;
+		res = protos[func->protoIdx](*this, func, fp);
+	}
+	return res;
+}
+
+void AotRuntime::enter(Value* fp, uint16_t argCnt, uint32_t maxStack) {
+	if(fp + maxStack >= stack->begin() + STACK_SIZE)
+		throw ExecutionError("Stack overflow");
+	// Slots above the previous top may hold stale values, which the GC must not see
+	std::fill(fp + argCnt, fp + maxStack, Value::nil());
+	stack->top = fp + maxStack;
+}
+
+Value& AotRuntime::getGlobal(Value*& cache, const char* name) {
+	if(!cache) {
+		auto it = globals->map.find(name);
+		if(it == globals->map.end()) throw ExecutionError(std::string("Tring to access undefined global ") + name);
+		cache = &it->second;
+	}
+	return *cache;
+}
+
+CFunction* AotRuntime::getMethod(CFunction*& cache, const char* ns, const char* name) {
+	if(!cache) {
+		Value* nsCache = nullptr;
+		Value nsValue = getGlobal(nsCache, ns);
+		Namespace* nsObject = nsValue.get<Namespace>();
+		if(!nsObject) throw ExecutionError("Tring to get method from non-namespace " + nsValue.toString());
+		auto it = nsObject->map.find(name);
+		if(it == nsObject->map.end()) throw ExecutionError("Cannot find implementation for method '" + std::string(name) + "'");
+		cache = it->second.get<CFunction>();
+		if(!cache) throw ExecutionError("Method implementation is not a CFunction");
+	}
+	return cache;
+}
+
+Value AotRuntime::call(Value funcValue, Value* args, uint16_t argCnt) {
+	Function* func = funcValue.get<Function>();
+	if(!func) return callNative(funcValue, args, argCnt);
+	if(argCnt != func->argCnt)
+		throw ExecutionError("Expected " + std::to_string(func->argCnt) + " arguments, got " + std::to_string(argCnt));
+	
+	Value* callerTop = stack->top;
+	calls->push(args - stack->begin(), argCnt, func);
+	Value res = execute(func->protoIdx, func, args);
+	calls->pop();
+	stack->top = callerTop;
+	return res;
+}
+
+Value AotRuntime::tailCall(Value* fp, Value funcValue, Value* args, uint16_t argCnt) {
+	calls->closeUpvalues(fp);
+	Function* func = funcValue.get<Function>();
+	if(!func) return callNative(funcValue, args, argCnt);
+	if(argCnt != func->argCnt)
+		throw ExecutionError("Expected " + std::to_string(func->argCnt) + " arguments, got " + std::to_string(argCnt));
+	
+	std::copy(args, args + argCnt, fp);
+	tailCallee = func;
+	return Value::nil();
+}
+
+// The arguments are followed by the slot of the function value, which is free
+Value AotRuntime::callNative(Value funcValue, Value* args, uint16_t argCnt) {
+	Method* method;
+	CFunction* cfunc;
+	if(method = funcValue.get<Method>()) {
+		std::copy_backward(args, args + argCnt, args + argCnt + 1);
+		*args = method->self;
+		return method->function->call(args, argCnt + 1);
+	} else if(cfunc = funcValue.get<CFunction>()) {
+		return cfunc->call(args, argCnt);
+	}
+	throw ExecutionError("Cannot call " + funcValue.getTypeDesc());
+}
+
+bool AotRuntime::condition(Value cond) {
+	if(!cond.isBool()) throw ExecutionError("Expected boolean in 'if' condition, got " + cond.toString());
+	return cond.getBool();
+}
+
+Value AotRuntime::logicalNot(Value val) {
+	if(!val.isBool()) throw ExecutionError("Cannot 'not' non-boolean value " + val.toString());
+	return Value(!val.getBool());
+}
+
+Value AotRuntime::logicalAnd(Value left, Value right) {
+	if(!left.isBool() || !right.isBool()) throw ExecutionError("Cannot 'and' " + left.toString() + " and " + right.toString());
+	return Value(left.getBool() && right.getBool());
+}
+
+Value AotRuntime::logicalOr(Value left, Value right) {
+	if(!left.isBool() || !right.isBool()) throw ExecutionError("Cannot 'or' " + left.toString() + " and " + right.toString());
+	return Value(left.getBool() || right.getBool());
+}
+
+Value AotRuntime::index(Value listValue, Value index) {
+	List* list = listValue.get<List>();
+	if(!list)
+		throw ExecutionError("Cannot index " + listValue.getTypeDesc());
+	if(!index.isInt())
+		throw ExecutionError("Cannot index list with " + index.getTypeDesc());
+	int32_t index2 = index.getInt();
+	if(index2 < 1 || index2 > list->vec.size())
+		throw ExecutionError("List index out of range: " + std::to_string(index2));
+	return list->vec[index2-1];
+}
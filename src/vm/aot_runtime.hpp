@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+
+#include "vm.hpp"
+
+class AotRuntime;
+
+// A function prototype translated to C++, called with its arguments at fp[0..argCnt)
+typedef Value (*AotFunction)(AotRuntime& rt, Function* closure, Value* fp);
+
+// Runtime support for the C++ generated by "somire aot" from a chunk. Translated
+// functions keep their locals and temporaries in the runtime's stack, at offsets
+// worked out by the translator, so that the GC can see them.
+class AotRuntime {
+public:
+	GC::Root<List> constants;
+	
+	AotRuntime(std::vector<AotFunction> protos);
+	
+	// Runs the main function, and reports execution errors. Returns the exit status.
+	int run();
+	
+	// Reserves a frame of maxStack values at fp, the arguments being already in place
+	void enter(Value* fp, uint16_t argCnt, uint32_t maxStack);
+	
+	Value& getGlobal(Value*& cache, const char* name);
+	CFunction* getMethod(CFunction*& cache, const char* ns, const char* name);
+	
+	Value call(Value funcValue, Value* args, uint16_t argCnt);
+	// Moves the arguments to fp to reuse the frame, and lets call() run the callee
+	Value tailCall(Value* fp, Value funcValue, Value* args, uint16_t argCnt);
+	
+	inline Upvalue* captureUpvalue(Value* local) { return calls->captureUpvalue(local); }
+	inline void closeUpvalues(Value* level) { calls->closeUpvalues(level); }
+	
+	static bool condition(Value cond);
+	static Value logicalNot(Value val);
+	static Value logicalAnd(Value left, Value right);
+	static Value logicalOr(Value left, Value right);
+	static Value index(Value listValue, Value index);
+	
+	// Typed int instructions: the static types don't prove that the operands
+	// are ints (a list may hold any value), so they fall back to the generic
+	// operations
+	static inline Value addInt(Value left, Value right) {
+		return left.isInt() && right.isInt() ? Value(left.getInt() + right.getInt()) : left.plus(right);
+	}
+	static inline Value subInt(Value left, Value right) {
+		return left.isInt() && right.isInt() ? Value(left.getInt() - right.getInt()) : left.minus(right);
+	}
+	static inline Value mulInt(Value left, Value right) {
+		return left.isInt() && right.isInt() ? Value(left.getInt() * right.getInt()) : left.multiply(right);
+	}
+	static inline Value modInt(Value left, Value right) {
+		return left.isInt() && right.isInt() ? Value(left.getInt() % right.getInt()) : left.modulo(right);
+	}
+	static inline bool equalsInt(Value left, Value right) {
+		return left.isInt() && right.isInt() ? left.getInt() == right.getInt() : left.equals(right);
+	}
+	static inline bool lessInt(Value left, Value right) {
+		return left.isInt() && right.isInt() ? left.getInt() < right.getInt() : left.less(right);
+	}
+	static inline bool lessOrEqInt(Value left, Value right) {
+		return left.isInt() && right.isInt() ? left.getInt() <= right.getInt() : left.less_or_eq(right);
+	}
+
+private:
+	std::vector<AotFunction> protos;
+	GC::Root<Namespace> globals;
+	GC::Root<Stack> stack;
+	GC::Root<CallStack> calls;
+	Function* tailCallee;
+	
+	Value execute(uint16_t protoIdx, Function* func, Value* fp);
+	Value callNative(Value funcValue, Value* args, uint16_t argCnt);
+};
@@ -0,0 +1,115 @@
+#include "decode.hpp"
+
+#include <string>
+
+namespace {
+
+void decodeFunction(Chunk& chunk, FunctionChunk& func, DecodedFunction& res) {
+	std::vector<uint8_t>& code = func.code;
+	std::vector<std::pair<uint32_t, uint32_t>> jumps; // instruction, target offset
+	res.instrIdx.assign(code.size() + 1, -1);
+	
+	auto constant = [&](uint16_t idx) {
+		if(idx >= chunk.constants->vec.size())
+			throw ExecutionError("Invalid constant index " + std::to_string(idx));
+		return chunk.constants->vec[idx];
+	};
+	
+	for(auto it = code.begin(); it != code.end();) {
+		uint32_t pos = it - code.begin();
+		res.instrIdx[pos] = res.code.size();
+		Opcode op = (Opcode) readUI8(it);
+		auto operands = it;
+		it = code.begin() + pos;
+		skipInstruction(it);
+		if(it > code.end())
+			throw ExecutionError("Truncated instruction at end of function");
+		
+		Instruction& instr = res.code.emplace_back(Instruction{ op });
+		switch(op) {
+		case Opcode::CONSTANT:
+			instr.constant = constant(readUI16(operands));
+			break;
+		case Opcode::POP:
+		case Opcode::GLOBAL:
+		case Opcode::GLOBAL_SLOT:
+		case Opcode::CALL:
+		case Opcode::TAIL_CALL:
+		case Opcode::MAKE_LIST:
+			instr.a = readUI16(operands);
+			break;
+		case Opcode::SET_LOCAL:
+		case Opcode::LOCAL:
+		case Opcode::ADD_INT_SET_LOCAL:
+			instr.a = readI16(operands);
+			break;
+		case Opcode::MAKE_METHOD:
+		case Opcode::MAKE_METHOD_SLOT:
+			instr.a = readUI16(operands);
+			instr.b = readUI16(operands);
+			break;
+		case Opcode::CALL_METHOD:
+		case Opcode::CALL_METHOD_SLOT:
+			instr.a = readUI16(operands);
+			instr.b = readUI16(operands);
+			instr.c = readUI16(operands);
+			break;
+		case Opcode::LOCAL_LOCAL:
+		case Opcode::JUMP_IF_NOT_LESS_LOCAL_LOCAL:
+			instr.a = readI16(operands);
+			instr.b = readI16(operands);
+			break;
+		case Opcode::LOCAL_CONSTANT:
+			instr.a = readI16(operands);
+			instr.constant = constant(readUI16(operands));
+			break;
+		// The constant of these is always an int
+		case Opcode::INC_LOCAL:
+		case Opcode::JUMP_IF_NOT_LESS_LOCAL_CONSTANT:
+			instr.a = readI16(operands);
+			instr.b = constant(readUI16(operands)).getInt();
+			break;
+		case Opcode::MAKE_FUNC:
+			instr.a = readUI16(operands);
+			instr.b = readUI16(operands);
+			instr.c = readUI16(operands);
+			for(int32_t i = 0; i < instr.c; i++) {
+				res.upvalues.push_back(readI16(operands));
+			}
+			break;
+		default:
+			break;
+		}
+		if(isJump(op))
+			jumps.emplace_back(res.code.size() - 1, (it - code.begin()) + readI16(operands));
+	}
+	
+	res.instrIdx[code.size()] = res.code.size();
+	res.code.push_back(Instruction{ Opcode::CONSTANT });
+	res.code.back().constant = Value::nil();
+	res.code.push_back(Instruction{ Opcode::RETURN });
+	
+	// The vectors are complete, pointers into them can be taken
+	for(auto& jump : jumps) {
+		if(jump.second > code.size() || res.instrIdx[jump.second] == -1)
+			throw ExecutionError("Invalid jump target " + std::to_string(jump.second));
+		res.code[jump.first].target = &res.code[res.instrIdx[jump.second]];
+	}
+	const int16_t* upvalues = res.upvalues.data();
+	for(Instruction& instr : res.code) {
+		if(instr.op == Opcode::MAKE_FUNC) {
+			instr.upvalues = upvalues;
+			upvalues += instr.c;
+		}
+	}
+}
+
+}
+
+std::vector<DecodedFunction> decodeChunk(Chunk& chunk) {
+	std::vector<DecodedFunction> res(chunk.functions.size());
+	for(uint32_t i = 0; i < chunk.functions.size(); i++) {
+		decodeFunction(chunk, *chunk.functions[i], res[i]);
+	}
+	return res;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "compiler/chunk.hpp"
+#include "value.hpp"
+
+// Fixed-width form of a stack instruction, which the interpreter runs instead
+// of the bytecode: operands are widened (local indices keeping their sign),
+// constants are resolved, and jumps point to their target directly. The
+// interpreter may also rewrite generic instructions into quickened ones.
+struct Instruction {
+	Opcode op;
+	int32_t a, b, c;
+	union {
+		Value constant; // CONSTANT, LOCAL_CONSTANT
+		Instruction* target; // jumps
+		const int16_t* upvalues; // MAKE_FUNC
+	};
+};
+
+struct DecodedFunction {
+	// Ends with an explicit "return nil", so that running off the end of the
+	// code doesn't have to be checked for
+	std::vector<Instruction> code;
+	std::vector<int16_t> upvalues;
+	std::vector<int32_t> instrIdx; // index in code of each bytecode offset, -1 inside instructions
+};
+
+// Decodes the code of every function prototype of a (linked) chunk. Invalid
+// operands throw an ExecutionError, as unverified chunks may have them.
+std::vector<DecodedFunction> decodeChunk(Chunk& chunk);
@@ -0,0 +1,379 @@
+#include "jit.hpp"
+#include "vm.hpp"
+
+#include <cstring>
+#include <initializer_list>
+#include <tuple>
+
+#if defined(__x86_64__) || defined(_M_X64)
+	#define JIT_X64
+	#ifdef _WIN32
+		#define WIN32_LEAN_AND_MEAN
+		#include <windows.h>
+		#undef IGNORE // conflicts with Opcode::IGNORE
+	#else
+		#include <sys/mman.h>
+	#endif
+#endif
+
+Jit::~Jit() {
+#ifdef JIT_X64
+	for(auto& block : blocks) {
+	#ifdef _WIN32
+		VirtualFree(block.first, 0, MEM_RELEASE);
+	#else
+		munmap(block.first, block.second);
+	#endif
+	}
+#endif
+}
+
+bool Jit::isSupported() {
+#ifdef JIT_X64
+	return true;
+#else
+	return false;
+#endif
+}
+
+#ifdef JIT_X64
+
+namespace {
+
+class Assembler {
+public:
+	std::vector<uint8_t> code;
+	
+	inline uint32_t pos() { return code.size(); }
+	inline void emit(std::initializer_list<uint8_t> bytes) { code.insert(code.end(), bytes); }
+	inline void emit32(uint32_t x) {
+		auto it = std::back_inserter(code);
+		writeUI32(it, x);
+	}
+	inline void emit64(uint64_t x) {
+		emit32((uint32_t) x);
+		emit32((uint32_t) (x >> 32));
+	}
+	// Emits a 32-bit relative offset to be patched later, and returns its position
+	inline uint32_t rel32() {
+		uint32_t at = pos();
+		emit32(0);
+		return at;
+	}
+	inline void patchRel32(uint32_t at, uint32_t target) {
+		auto it = code.begin() + at;
+		writeI32(it, (int32_t) (target - (at + 4)));
+	}
+};
+
+// Copies code to new executable memory, returns nullptr on failure
+void* makeExecutable(std::vector<uint8_t>& code) {
+#ifdef _WIN32
+	void* mem = VirtualAlloc(nullptr, code.size(), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if(!mem) return nullptr;
+	std::memcpy(mem, code.data(), code.size());
+	DWORD oldProtect;
+	if(!VirtualProtect(mem, code.size(), PAGE_EXECUTE_READ, &oldProtect)) {
+		VirtualFree(mem, 0, MEM_RELEASE);
+		return nullptr;
+	}
+#else
+	void* mem = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED) return nullptr;
+	std::memcpy(mem, code.data(), code.size());
+	if(mprotect(mem, code.size(), PROT_READ | PROT_EXEC) != 0) {
+		munmap(mem, code.size());
+		return nullptr;
+	}
+#endif
+	return mem;
+}
+
+}
+
+// Register usage:
+//   rbx = stack top, r12 = base of the locals,
+//   r13 = address of the VM stack top, r14 = execution record
+JitCode Jit::compile(Chunk& chunk, uint32_t funcIdx, Value* globalSlots) {
+	std::vector<uint8_t>& code = chunk.functions[funcIdx]->code;
+	
+	// Locals can only be captured by closures made in the same frame
+	bool capturesLocals;
+	std::vector<bool> isJumpTarget = findJumpTargets(code, &capturesLocals);
+	
+	const uint64_t intTag = Value((int32_t) 0).getBits();
+	const uint64_t boolTag = Value(false).getBits();
+	const uint8_t localCntOffset = offsetof(ExecutionRecord, localCnt);
+	const uint8_t resumeOffset = offsetof(ExecutionRecord, jitResume);
+	
+	Assembler a;
+	std::vector<uint32_t> labels(code.size() + 1); // native offset of each instruction
+	std::vector<std::pair<uint32_t, uint32_t>> jumps; // rel32 position, bytecode target
+	std::vector<uint32_t> exits; // rel32 positions of jumps to the epilogue
+	
+	// Prologue
+	a.emit({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56}); // push rbx; push r12; push r13; push r14
+#ifdef _WIN32
+	a.emit({0x49, 0x89, 0xCD}); // mov r13, rcx
+	a.emit({0x49, 0x89, 0xD4}); // mov r12, rdx
+	a.emit({0x4D, 0x89, 0xC6}); // mov r14, r8
+	a.emit({0x49, 0x8B, 0x5D, 0x00}); // mov rbx, [r13]
+	a.emit({0x4D, 0x85, 0xC9}); // test r9, r9
+	a.emit({0x0F, 0x84}); jumps.emplace_back(a.rel32(), 0); // jz start
+	a.emit({0x41, 0xFF, 0xE1}); // jmp r9
+#else
+	a.emit({0x49, 0x89, 0xFD}); // mov r13, rdi
+	a.emit({0x49, 0x89, 0xF4}); // mov r12, rsi
+	a.emit({0x49, 0x89, 0xD6}); // mov r14, rdx
+	a.emit({0x49, 0x8B, 0x5D, 0x00}); // mov rbx, [r13]
+	a.emit({0x48, 0x85, 0xC9}); // test rcx, rcx
+	a.emit({0x0F, 0x84}); jumps.emplace_back(a.rel32(), 0); // jz start
+	a.emit({0xFF, 0xE1}); // jmp rcx
+#endif
+	
+	// Hands the instruction at 'pos' over to the interpreter, to resume at 'next'
+	auto exitTo = [&](uint32_t pos, uint32_t next) {
+		a.emit({0x48, 0x8D, 0x05}); jumps.emplace_back(a.rel32(), next); // lea rax, [rip + next]
+		a.emit({0x49, 0x89, 0x46, resumeOffset}); // mov [r14 + jitResume], rax
+		a.emit({0xB8}); a.emit32(pos); // mov eax, pos
+		a.emit({0xE9}); exits.push_back(a.rel32()); // jmp epilogue
+	};
+	
+	auto pushLocal = [&](int16_t idx) {
+		a.emit({0x49, 0x8B, 0x84, 0x24}); a.emit32(8*idx); // mov rax, [r12 + 8*idx]
+		a.emit({0x48, 0x89, 0x03, 0x48, 0x83, 0xC3, 0x08}); // mov [rbx], rax; add rbx, 8
+	};
+	auto pushConstant = [&](uint16_t constantIdx) {
+		a.emit({0x48, 0xB8}); a.emit64(chunk.constants->vec[constantIdx].getBits()); // mov rax, value
+		a.emit({0x48, 0x89, 0x03, 0x48, 0x83, 0xC3, 0x08}); // mov [rbx], rax; add rbx, 8
+	};
+	// The static types don't prove that the operands of typed instructions are
+	// ints (a list may hold any value), so they are checked first. On mismatch,
+	// the interpreter runs the instruction (with the generic operation), then
+	// resumes at 'resume'. Instructions which jump can't run on their own, there
+	// the interpreter carries on with the rest of the frame (FINISH_FRAME).
+	const uint32_t FINISH_FRAME = UINT32_MAX;
+	std::vector<std::tuple<uint32_t, uint32_t, uint32_t>> guards; // rel32 position, instruction, resume
+	auto guardInt = [&](uint32_t pos, uint32_t resume) { // value in rax
+		a.emit({0x48, 0xC1, 0xE8, 0x30}); // shr rax, 48
+		a.emit({0x3D}); a.emit32(intTag >> 48); // cmp eax, int tag
+		a.emit({0x0F, 0x85}); guards.emplace_back(a.rel32(), pos, resume); // jne guard exit
+	};
+	auto guardTopInts = [&](uint32_t pos, uint32_t resume) {
+		a.emit({0x48, 0x8B, 0x43, 0xF0}); // mov rax, [rbx - 16]
+		guardInt(pos, resume);
+		a.emit({0x48, 0x8B, 0x43, 0xF8}); // mov rax, [rbx - 8]
+		guardInt(pos, resume);
+	};
+	auto guardLocalInt = [&](int16_t idx, uint32_t pos, uint32_t resume) {
+		a.emit({0x49, 0x8B, 0x84, 0x24}); a.emit32(8*idx); // mov rax, [r12 + 8*idx]
+		guardInt(pos, resume);
+	};
+	// Tags the int in eax, and stores it in a local
+	auto setLocalInt = [&](int16_t idx) {
+		a.emit({0x48, 0xB9}); a.emit64(intTag); // mov rcx, int tag
+		a.emit({0x48, 0x09, 0xC8}); // or rax, rcx
+		a.emit({0x49, 0x89, 0x84, 0x24}); a.emit32(8*idx); // mov [r12 + 8*idx], rax
+	};
+	
+	auto it = code.begin();
+	while(it != code.end()) {
+		uint32_t pos = it - code.begin();
+		labels[pos] = a.pos();
+		Opcode op = (Opcode) readUI8(it);
+		auto operands = it;
+		it = code.begin() + pos;
+		skipInstruction(it);
+		uint32_t next = it - code.begin();
+		
+		switch(op) {
+		case Opcode::IGNORE:
+			a.emit({0x48, 0x83, 0xEB, 0x08}); // sub rbx, 8
+			break;
+		case Opcode::CONSTANT:
+			pushConstant(readUI16(operands));
+			break;
+		case Opcode::GLOBAL_SLOT:
+			a.emit({0x48, 0xB8}); a.emit64((uint64_t) &globalSlots[readUI16(operands)]); // mov rax, slot
+			a.emit({0x48, 0x8B, 0x00}); // mov rax, [rax]
+			a.emit({0x48, 0x89, 0x03, 0x48, 0x83, 0xC3, 0x08}); // mov [rbx], rax; add rbx, 8
+			break;
+		case Opcode::LOCAL: {
+			int16_t idx = readI16(operands);
+			if(idx < 0) {
+				exitTo(pos, next);
+				break;
+			}
+			pushLocal(idx);
+			break;
+		} case Opcode::SET_LOCAL: {
+			int16_t idx = readI16(operands);
+			if(idx < 0) {
+				exitTo(pos, next);
+				break;
+			}
+			a.emit({0x48, 0x83, 0xEB, 0x08, 0x48, 0x8B, 0x03}); // sub rbx, 8; mov rax, [rbx]
+			a.emit({0x49, 0x89, 0x84, 0x24}); a.emit32(8*idx); // mov [r12 + 8*idx], rax
+			break;
+		} case Opcode::LET:
+			a.emit({0x41, 0xFF, 0x46, localCntOffset}); // inc dword [r14 + localCnt]
+			break;
+		case Opcode::POP: {
+			if(capturesLocals) { // upvalues may need closing
+				exitTo(pos, next);
+				break;
+			}
+			uint16_t amount = readUI16(operands);
+			a.emit({0x41, 0x81, 0x6E, localCntOffset}); a.emit32(amount); // sub dword [r14 + localCnt], amount
+			a.emit({0x48, 0x81, 0xEB}); a.emit32(8*amount); // sub rbx, 8*amount
+			break;
+		} case Opcode::JUMP: {
+			int16_t relJump = readI16(operands);
+			a.emit({0xE9}); jumps.emplace_back(a.rel32(), next + relJump); // jmp target
+			break;
+		} case Opcode::JUMP_IF_NOT: {
+			int16_t relJump = readI16(operands);
+			a.emit({0x48, 0x83, 0xEB, 0x08, 0x48, 0x8B, 0x03}); // sub rbx, 8; mov rax, [rbx]
+			a.emit({0x48, 0xB9}); a.emit64(boolTag); // mov rcx, false
+			a.emit({0x48, 0x39, 0xC8}); // cmp rax, rcx
+			a.emit({0x0F, 0x84}); jumps.emplace_back(a.rel32(), next + relJump); // je target
+			a.emit({0x48, 0xFF, 0xC1}); // inc rcx
+			a.emit({0x48, 0x39, 0xC8}); // cmp rax, rcx
+			a.emit({0x0F, 0x84}); jumps.emplace_back(a.rel32(), next); // je next
+			// Not a boolean: let the interpreter report the error
+			a.emit({0x48, 0x83, 0xC3, 0x08}); // add rbx, 8
+			exitTo(pos, next);
+			break;
+		} case Opcode::ADD_INT:
+		case Opcode::SUB_INT:
+		case Opcode::MUL_INT:
+			guardTopInts(pos, next);
+			a.emit({0x8B, 0x43, 0xF0}); // mov eax, [rbx - 16]
+			if(op == Opcode::ADD_INT)
+				a.emit({0x03, 0x43, 0xF8}); // add eax, [rbx - 8]
+			else if(op == Opcode::SUB_INT)
+				a.emit({0x2B, 0x43, 0xF8}); // sub eax, [rbx - 8]
+			else
+				a.emit({0x0F, 0xAF, 0x43, 0xF8}); // imul eax, [rbx - 8]
+			a.emit({0x48, 0xB9}); a.emit64(intTag); // mov rcx, int tag
+			a.emit({0x48, 0x09, 0xC8}); // or rax, rcx
+			a.emit({0x48, 0x89, 0x43, 0xF0, 0x48, 0x83, 0xEB, 0x08}); // mov [rbx - 16], rax; sub rbx, 8
+			break;
+		case Opcode::EQUALS_INT:
+		case Opcode::LESS_INT:
+		case Opcode::LESS_OR_EQ_INT: {
+			uint8_t setcc = op == Opcode::EQUALS_INT ? 0x94 : op == Opcode::LESS_INT ? 0x9C : 0x9E;
+			if(next < code.size() && (Opcode) code[next] == Opcode::JUMP_IF_NOT && !isJumpTarget[next]) {
+				// Compare and branch directly, with the inverse condition
+				auto jumpOperands = code.begin() + next + 1;
+				int16_t relJump = readI16(jumpOperands);
+				uint32_t target = next + 3 + relJump;
+				guardTopInts(pos, FINISH_FRAME);
+				a.emit({0x48, 0x83, 0xEB, 0x10}); // sub rbx, 16
+				a.emit({0x8B, 0x03, 0x3B, 0x43, 0x08}); // mov eax, [rbx]; cmp eax, [rbx + 8]
+				a.emit({0x0F, (uint8_t) (setcc - 0x10 + 1)}); jumps.emplace_back(a.rel32(), target); // jcc target
+				labels[next] = a.pos();
+				it = code.begin() + next + 3;
+				break;
+			}
+			guardTopInts(pos, next);
+			a.emit({0x8B, 0x43, 0xF0, 0x3B, 0x43, 0xF8}); // mov eax, [rbx - 16]; cmp eax, [rbx - 8]
+			a.emit({0x0F, setcc, 0xC0, 0x0F, 0xB6, 0xC0}); // setcc al; movzx eax, al
+			a.emit({0x48, 0xB9}); a.emit64(boolTag); // mov rcx, bool tag
+			a.emit({0x48, 0x09, 0xC8}); // or rax, rcx
+			a.emit({0x48, 0x89, 0x43, 0xF0, 0x48, 0x83, 0xEB, 0x08}); // mov [rbx - 16], rax; sub rbx, 8
+			break;
+		} case Opcode::LOCAL_LOCAL:
+			pushLocal(readI16(operands));
+			pushLocal(readI16(operands));
+			break;
+		case Opcode::LOCAL_CONSTANT:
+			pushLocal(readI16(operands));
+			pushConstant(readUI16(operands));
+			break;
+		case Opcode::INC_LOCAL: {
+			int16_t idx = readI16(operands);
+			guardLocalInt(idx, pos, next);
+			a.emit({0x41, 0x8B, 0x84, 0x24}); a.emit32(8*idx); // mov eax, [r12 + 8*idx]
+			a.emit({0x05}); a.emit32(chunk.constants->vec[readUI16(operands)].getInt()); // add eax, step
+			setLocalInt(idx);
+			break;
+		} case Opcode::ADD_INT_SET_LOCAL:
+			guardTopInts(pos, next);
+			a.emit({0x8B, 0x43, 0xF0, 0x03, 0x43, 0xF8}); // mov eax, [rbx - 16]; add eax, [rbx - 8]
+			a.emit({0x48, 0x83, 0xEB, 0x10}); // sub rbx, 16
+			setLocalInt(readI16(operands));
+			break;
+		case Opcode::JUMP_IF_NOT_LESS_INT:
+		case Opcode::JUMP_IF_NOT_LESS_OR_EQ_INT: {
+			int16_t relJump = readI16(operands);
+			guardTopInts(pos, FINISH_FRAME);
+			a.emit({0x48, 0x83, 0xEB, 0x10}); // sub rbx, 16
+			a.emit({0x8B, 0x03, 0x3B, 0x43, 0x08}); // mov eax, [rbx]; cmp eax, [rbx + 8]
+			a.emit({0x0F, (uint8_t) (op == Opcode::JUMP_IF_NOT_LESS_INT ? 0x8D : 0x8F)}); // jge/jg target
+			jumps.emplace_back(a.rel32(), next + relJump);
+			break;
+		} case Opcode::JUMP_IF_NOT_LESS_LOCAL_LOCAL:
+		case Opcode::JUMP_IF_NOT_LESS_LOCAL_CONSTANT: {
+			int16_t left = readI16(operands);
+			guardLocalInt(left, pos, FINISH_FRAME);
+			a.emit({0x41, 0x8B, 0x84, 0x24}); a.emit32(8*left); // mov eax, [r12 + 8*left]
+			if(op == Opcode::JUMP_IF_NOT_LESS_LOCAL_LOCAL) {
+				int16_t right = readI16(operands);
+				guardLocalInt(right, pos, FINISH_FRAME);
+				a.emit({0x41, 0x8B, 0x84, 0x24}); a.emit32(8*left); // mov eax, [r12 + 8*left]
+				a.emit({0x41, 0x3B, 0x84, 0x24}); a.emit32(8*right); // cmp eax, [r12 + 8*right]
+			} else {
+				a.emit({0x3D}); a.emit32(chunk.constants->vec[readUI16(operands)].getInt()); // cmp eax, right
+			}
+			int16_t relJump = readI16(operands);
+			a.emit({0x0F, 0x8D}); jumps.emplace_back(a.rel32(), next + relJump); // jge target
+			break;
+		} default:
+			exitTo(pos, next);
+			break;
+		}
+	}
+	
+	// End of function: let the interpreter do the implicit return
+	labels[code.size()] = a.pos();
+	a.emit({0x49, 0xC7, 0x46, resumeOffset}); a.emit32(0); // mov qword [r14 + jitResume], 0
+	a.emit({0xB8}); a.emit32(code.size()); // mov eax, code size
+	
+	// Epilogue
+	uint32_t epilogue = a.pos();
+	a.emit({0x49, 0x89, 0x5D, 0x00}); // mov [r13], rbx
+	a.emit({0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3}); // pop r14; pop r13; pop r12; pop rbx; ret
+	
+	// Guard exits, out of line
+	for(auto& [at, pos, resume] : guards) {
+		a.patchRel32(at, a.pos());
+		if(resume != FINISH_FRAME) {
+			exitTo(pos, resume);
+			continue;
+		}
+		a.emit({0x49, 0xC7, 0x46, resumeOffset}); a.emit32(0); // mov qword [r14 + jitResume], 0
+		a.emit({0xB8}); a.emit32(pos); // mov eax, pos
+		a.emit({0xE9}); exits.push_back(a.rel32()); // jmp epilogue
+	}
+	
+	for(auto& jump : jumps) {
+		a.patchRel32(jump.first, labels[jump.second]);
+	}
+	for(uint32_t exit : exits) {
+		a.patchRel32(exit, epilogue);
+	}
+	
+	void* mem = makeExecutable(a.code);
+	if(!mem) return nullptr;
+	blocks.emplace_back(mem, a.code.size());
+	return reinterpret_cast<JitCode>(mem);
+}
+
+#else
+
+JitCode Jit::compile(Chunk& chunk, uint32_t funcIdx, Value* globalSlots) {
+	return nullptr;
+}
+
+#endif
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "compiler/chunk.hpp"
+#include "value.hpp"
+
+struct ExecutionRecord;
+
+// Number of calls after which a function prototype gets compiled, by default
+const uint32_t JIT_THRESHOLD = 100;
+
+// Compiled code runs a function from its start, or from a resume point, until it
+// reaches an instruction it doesn't implement. It then returns the offset of that
+// instruction for the interpreter to execute it, and sets record->jitResume to
+// where to continue afterwards (nullptr at the end of the function, or if the
+// interpreter is to run the rest of the frame).
+// It never calls back into the VM, so errors and calls are always handled by
+// the interpreter, and there are no native frames to unwind.
+typedef uint32_t (*JitCode)(Value** top, Value* localBase, ExecutionRecord* record, const void* resume);
+
+// Baseline JIT: translates the bytecode of a verified function prototype to
+// x86-64 code, instruction by instruction, working directly on the VM stack.
+class Jit {
+public:
+	Jit() = default;
+	Jit(const Jit&) = delete;
+	~Jit();
+	
+	static bool isSupported();
+	
+	// Returns nullptr if the platform is not supported
+	JitCode compile(Chunk& chunk, uint32_t funcIdx, Value* globalSlots);
+
+private:
+	std::vector<std::pair<void*, size_t>> blocks;
+};
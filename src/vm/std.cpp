@@ -2,10 +2,12 @@
 
 #include <string>
 #include <iostream>
+#include <fstream>
+#include <sstream>
 
-void checkNumber(std::vector<Value>& values, uint32_t number) {
-	if(values.size() != number)
-		throw ExecutionError("Expected " + std::to_string(number) + " arguments, got " + std::to_string(values.size()));
+void checkNumber(uint32_t argCnt, uint32_t number) {
+	if(argCnt != number)
+		throw ExecutionError("Expected " + std::to_string(number) + " arguments, got " + std::to_string(argCnt));
 }
 
 void expectType(Value val, bool isType, int argument, std::string expectedType) {
@@ -21,38 +23,39 @@ T& expectObject(Value val, int argument, std::string expectedType) {
 	return *obj;
 }
 
-Value log(std::vector<Value>& args) {
-	for(uint32_t i = 0; i < args.size(); i++) {
+Value log(Value* args, uint32_t argCnt) {
+	for(uint32_t i = 0; i < argCnt; i++) {
 		std::cout << args[i].toString();
-		if(i != args.size() - 1)
+		if(i != argCnt - 1)
 			std::cout << " ";
 	}
 	std::cout << std::endl;
 	return Value::nil();
 }
 
-Value repr(std::vector<Value>& args) {
+Value repr(Value* args, uint32_t argCnt) {
 	return Value(new String(args[0].toString()));
 }
 
-Value write(std::vector<Value>& args) {
+Value write(Value* args, uint32_t argCnt) {
 	String& s = *args[0].get<String>();
 	std::cout << s.str;
 	return Value::nil();
 }
 
-Value writeLine(std::vector<Value>& args) {
+Value writeLine(Value* args, uint32_t argCnt) {
 	String& s = *args[0].get<String>();
 	std::cout << s.str << std::endl;
 	return Value::nil();
 }
 
-Value listAdd(std::vector<Value>& args) {
-	if(args.size() == 0) throw ExecutionError("Did not get self argument");
-	if(args.size() == 1 || args.size() >= 4)
-		throw ExecutionError("Expected 1 or 2 arguments in add, got " + std::to_string(args.size()-1));
+Value listAdd(Value* args, uint32_t argCnt) {
+	if(argCnt == 0) throw ExecutionError("Did not get self argument");
+	if(argCnt == 1 || argCnt >= 4)
+		throw ExecutionError("Expected 1 or 2 arguments in add, got " + std::to_string(argCnt-1));
 	List& list = expectObject<List>(args[0], 0, "list");
-	if(args.size() == 2) {
+	size_t capacity = list.vec.capacity();
+	if(argCnt == 2) {
 		list.vec.push_back(args[1]);
 	} else {
 		expectType(args[2], args[2].isInt(), 2, "int");
@@ -63,15 +66,32 @@ Value listAdd(std::vector<Value>& args) {
 			throw ExecutionError("Provided list index is past the end");
 		list.vec.insert(list.vec.begin() + (pos - 1), args[1]);
 	}
+	if(list.vec.capacity() != capacity)
+		GC::allocateExternal((list.vec.capacity() - capacity) * sizeof(Value));
+	GC::writeBarrier(&list, args[1]);
 	return Value::nil();
 }
 
-Value listSize(std::vector<Value>& args) {
+Value listSize(Value* args, uint32_t argCnt) {
 	List& list = *args[0].get<List>();
 	return Value((int32_t) list.vec.size());
 }
 
-Value toBool(std::vector<Value>& args) {
+Value gcStats(Value* args, uint32_t argCnt) {
+	std::ostringstream out;
+	GC::writeStats(out);
+	return Value(new String(out.str()));
+}
+
+Value dumpHeap(Value* args, uint32_t argCnt) {
+	String& path = expectObject<String>(args[0], 0, "string");
+	std::ofstream out(path.str);
+	if(!out) throw ExecutionError("Could not open heap dump file " + path.str);
+	GC::dumpHeap(out);
+	return Value::nil();
+}
+
+Value toBool(Value* args, uint32_t argCnt) {
 	if(!args[0].isBool())
 		throw ExecutionError("Cannot convert " + args[0].toString() + " to bool");
 	return args[0];
@@ -83,6 +103,8 @@ void loadStd(Namespace& ns) {
 	ns.map["write"] = Value(new CFunction(write));
 	ns.map["writeLine"] = Value(new CFunction(writeLine));
 	ns.map["bool"] = Value(new CFunction(toBool));
+	ns.map["gcStats"] = Value(new CFunction(gcStats));
+	ns.map["dumpHeap"] = Value(new CFunction(dumpHeap));
 	
 	Namespace* listNs = new Namespace();
 	ns.map["list"] = listNs;
@@ -96,4 +118,6 @@ void defineStdTypes(TypeNamespace& ns, TypeNamespace& types) {
 	ns.map["write"] = new FunctionType({types.map["string"]}, types.map["nil"]);
 	ns.map["writeLine"] = new FunctionType({types.map["string"]}, types.map["nil"]);
 	ns.map["bool"] = new FunctionType({types.map["any"]}, types.map["bool"]);
+	ns.map["gcStats"] = new FunctionType({}, types.map["string"]);
+	ns.map["dumpHeap"] = new FunctionType({types.map["string"]}, types.map["nil"]);
 }
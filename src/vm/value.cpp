@@ -1,5 +1,6 @@
 #include "value.hpp"
 
+#include <algorithm>
 #include <string>
 #include <sstream>
 #include <cmath>
@@ -11,16 +12,6 @@ ExecutionError::ExecutionError(const std::string& what)
 	: runtime_error("Execution error: " + what) { }
 
 
-Value Value::nil() { return Value::fromBits((uint64_t) NIL); }
-Value::Value(bool boolean) : asBits(BOOL_TAG | (uint32_t) boolean) {}
-Value::Value(int32_t integer) : asBits(INT_TAG | (uint32_t) integer) {}
-
-Value::Value(double real) {
-	if(real > OBJECT_TAG)
-		throw std::runtime_error("No payload is allowed in quiet NaNs");
-	asDouble = real;
-}
-
 Value::Value(Object* obj) {
 	uint64_t add = reinterpret_cast<uint64_t>(obj);
 	if(add == 0)
@@ -194,12 +185,27 @@ void Namespace::markChildren() {
 }
 
 
-List::List(std::vector<Value>&& vec) : vec(std::move(vec)) {}
+List::List(std::vector<Value>&& vec) : vec(std::move(vec)) {
+	GC::allocateExternal(externalSize());
+}
 
 void List::markChildren() {
-	for(Value val : vec) {
-		val.mark();
+	markChildrenFrom(0);
+}
+
+// Lists only grow, and elements inserted while marking are marked by the
+// write barrier, so the elements left to mark are still past 'from'
+void List::markChildrenFrom(size_t from) {
+	size_t end = std::min(vec.size(), from + GC::MARK_BATCH);
+	for(size_t i = from; i < end; i++) {
+		vec[i].mark();
 	}
+	if(end < vec.size())
+		GC::markLater(this, end);
+}
+
+size_t List::externalSize() {
+	return vec.capacity() * sizeof(Value);
 }
 
 std::string List::toString() {
@@ -214,15 +220,24 @@ std::string List::toString() {
 }
 
 
-String::String(std::string str) : str(str) {}
+String::String(std::string str) : str(str) {
+	GC::allocateExternal(externalSize());
+}
 
 Value String::plus(Value other) {
 	String* otherStr;
-	if(otherStr = other.get<String>())
+	if(!(otherStr = other.get<String>()))
 		throw ExecutionError("Cannot add string to " + other.getTypeDesc());
 	return Value(new String(str + otherStr->str));
 }
 
+// Short strings are stored inline, in the slot of the object
+size_t String::externalSize() {
+	const char* data = str.data();
+	bool isInline = data >= (const char*) this && data < (const char*) (this + 1);
+	return isInline ? 0 : str.capacity() + 1;
+}
+
 bool String::equals(Object& obj) {
 	return str == static_cast<String&>(obj).str;
 }
@@ -232,38 +247,25 @@ std::string String::toString() {
 }
 
 
-CFunction::CFunction(std::function<Value(std::vector<Value>&)> func) : func(func) {}
+CFunction::CFunction(NativeFunction func) : func(func) {}
 
+CFunction::CFunction(LegacyNativeFunction func) : func(nullptr), legacyFunc(func) {}
 
-ExecutionRecord::ExecutionRecord(uint32_t localBase, uint32_t localCnt, Function* func)
-	: localBase(localBase), localCnt(localCnt), funcIdx(0), codeOffset(0), func(func) {
-	if(func) {
-		GC::pin(func);
-	}
+Value CFunction::callLegacy(Value* args, uint32_t argCnt) {
+	std::vector<Value> argVec(args, args + argCnt);
+	return legacyFunc(argVec);
 }
 
-ExecutionRecord::~ExecutionRecord() {
-	if(func) {
-		GC::unpin(func);
-	}
-}
 
-
-Upvalue::Upvalue(Value* local, ExecutionRecord* record, uint16_t localIdx)
-	: pointer(local), record(record), localIdx(localIdx) {}
-
-Upvalue::~Upvalue() {
-	if(record) {
-		record->upvalueBackPointers.erase(localIdx);
-	}
-}
+Upvalue::Upvalue(Value* local, Upvalue* nextOpen) : nextOpen(nextOpen), pointer(local), storage(Value::nil()) {}
 
 void Upvalue::markChildren() { storage.mark(); }
 
 void Upvalue::close() {
 	storage = *pointer;
 	pointer = &storage;
-	record = nullptr;
+	nextOpen = nullptr;
+	GC::writeBarrier(this, storage);
 }
 
 
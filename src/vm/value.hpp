@@ -17,10 +17,14 @@ class Object;
 class Value {
 public:
 	Value() = default;
-	static Value nil();
-	Value(bool boolean);
-	Value(int32_t integer);
-	Value(double real);
+	inline static Value nil() { return Value::fromBits(NIL); }
+	inline Value(bool boolean) : asBits(BOOL_TAG | (uint32_t) boolean) {}
+	inline Value(int32_t integer) : asBits(INT_TAG | (uint32_t) integer) {}
+	inline Value(double real) {
+		if(real > OBJECT_TAG)
+			throw std::runtime_error("No payload is allowed in quiet NaNs");
+		asDouble = real;
+	}
 	Value(Object* obj);
 	
 	inline bool isNil() { return asBits == NIL; }
@@ -36,6 +40,7 @@ public:
 	inline int32_t getInt() { return (int32_t) ((uint32_t) asBits); }
 	inline double getReal() { return asDouble; }
 	inline Object* getObject() { return reinterpret_cast<Object*>(asBits & 0xffffffffffff); }
+	inline uint64_t getBits() { return asBits; }
 	
 	template<typename T>
 	inline T* get() { return isObject() ? dynamic_cast<T*>(getObject()) : nullptr; }
@@ -90,6 +95,12 @@ public:
 	virtual std::string toString();
 };
 
+namespace GC {
+	inline void writeBarrier(GCObject* obj, Value val) {
+		if(val.isObject()) writeBarrier(obj, val.getObject());
+	}
+}
+
 class Namespace : public Object {
 public:
 	std::unordered_map<std::string, Value> map;
@@ -108,6 +119,8 @@ public:
 	std::string toString() override;
 	
 	void markChildren() override;
+	void markChildrenFrom(size_t from) override;
+	size_t externalSize() override;
 };
 
 class String : public Object {
@@ -122,51 +135,54 @@ public:
 	
 	std::string getTypeDesc() override { return "string"; }
 	std::string toString() override;
+	
+	size_t externalSize() override;
 };
 
+// Native functions receive their arguments in place, as a view into the VM stack
+typedef Value (*NativeFunction)(Value* args, uint32_t argCnt);
+typedef std::function<Value(std::vector<Value>&)> LegacyNativeFunction;
+
 class CFunction : public Object {
 public:
-	std::function<Value(std::vector<Value>&)> func;
+	NativeFunction func;
+	LegacyNativeFunction legacyFunc;
 	
-	CFunction(std::function<Value(std::vector<Value>&)> func);
-	
-	std::string getTypeDesc() override { return "C function"; }
-};
-
-
-class Upvalue;
-class Function;
-
-struct ExecutionRecord {
-	uint32_t localBase;
-	uint32_t localCnt;
+	CFunction(NativeFunction func);
+	// Compatibility shim for natives taking their arguments as a vector; these
+	// still pay for a copy of the arguments on every call.
+	CFunction(LegacyNativeFunction func);
 	
-	uint32_t funcIdx;
-	uint32_t codeOffset;
+	inline Value call(Value* args, uint32_t argCnt) {
+		return func ? func(args, argCnt) : callLegacy(args, argCnt);
+	}
 	
-	Function* func;
-	std::unordered_map<uint16_t, Upvalue*> upvalueBackPointers;
+	std::string getTypeDesc() override { return "C function"; }
 	
-	ExecutionRecord(uint32_t localBase, uint32_t localCnt, Function* func = nullptr);
-	~ExecutionRecord();
+private:
+	Value callLegacy(Value* args, uint32_t argCnt);
 };
 
+
 class Upvalue : public GC::GCObject {
 public:
-	Upvalue(Value* local, ExecutionRecord* record, uint16_t localIdx);
-	~Upvalue();
+	Upvalue* nextOpen; // while open, next upvalue in the VM's list of open upvalues
+	
+	Upvalue(Value* local, Upvalue* nextOpen);
 	
 	void markChildren() override;
 	
 	inline Value& resolve() { return *pointer; }
+	inline void set(Value val) {
+		*pointer = val;
+		GC::writeBarrier(this, val);
+	}
+	inline Value* getPointer() { return pointer; }
 	void close();
 	
 private:
 	Value* pointer;
 	Value storage;
-	
-	ExecutionRecord* record;
-	uint16_t localIdx;
 };
 
 class Function : public Object {
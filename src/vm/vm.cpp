@@ -1,7 +1,11 @@
 #include "vm.hpp"
+#include "compiler/registers.hpp"
 
 #include <iostream>
 #include <string>
+#include <cmath>
+#include <algorithm>
+#include <tuple>
 
 
 Stack::Stack() : base(&array[0]), top((Value*) base) {}
@@ -24,206 +28,616 @@ void Stack::markChildren() {
 }
 
 
-VM::VM() : globals(new Namespace()), stack(new Stack()) {
+CallStack::CallStack() : top(frames.data()), openUpvalues(nullptr) {}
+
+void CallStack::markChildren() {
+	for(ExecutionRecord* record = frames.data(); record != top; record++) {
+		if(record->func) record->func->mark();
+	}
+	for(Upvalue* upvalue = openUpvalues; upvalue; upvalue = upvalue->nextOpen) {
+		upvalue->mark();
+	}
+}
+
+// Returns the open upvalue pointing to a local, creating it if needed
+Upvalue* CallStack::captureUpvalue(Value* local) {
+	Upvalue** link = &openUpvalues;
+	while(*link && (*link)->getPointer() > local) {
+		link = &(*link)->nextOpen;
+	}
+	if(*link && (*link)->getPointer() == local)
+		return *link;
+	Upvalue* upvalue = new Upvalue(local, *link);
+	*link = upvalue;
+	return upvalue;
+}
+
+// Closes all open upvalues pointing to locals at or above 'level' in the stack
+void CallStack::closeUpvalues(Value* level) {
+	Upvalue*& open = openUpvalues;
+	while(open && open->getPointer() >= level) {
+		Upvalue* upvalue = open;
+		open = upvalue->nextOpen;
+		upvalue->close();
+	}
+}
+
+
+VM::VM() : globals(new Namespace()), globalSlots(new List()), stack(new Stack()), calls(new CallStack()),
+		jitEnabled(Jit::isSupported()), jitThreshold(JIT_THRESHOLD) {
 	loadStd(*globals);
+	assignGlobalSlots();
+}
+
+void VM::setJitEnabled(bool enabled) {
+	jitEnabled = enabled && Jit::isSupported();
+}
+
+void VM::setJitThreshold(uint32_t calls) {
+	jitThreshold = std::max(calls, (uint32_t) 1);
+}
+
+// Gives every global, and every method of a global namespace, a slot in the
+// global table. Slots are assigned in name order, so that they only depend on
+// the contents of the std, and a linked chunk stays valid for any VM.
+void VM::assignGlobalSlots() {
+	std::vector<std::pair<std::string, Value>> entries;
+	for(auto& pair : globals->map) {
+		entries.push_back(pair);
+		Namespace* ns = pair.second.get<Namespace>();
+		if(ns) {
+			for(auto& pair2 : ns->map) {
+				entries.emplace_back(pair.first + "." + pair2.first, pair2.second);
+			}
+		}
+	}
+	std::sort(entries.begin(), entries.end(),
+		[](auto& a, auto& b) { return a.first < b.first; });
+	if(entries.size() > 0xffff)
+		throw std::runtime_error("Too many globals");
+	for(auto& entry : entries) {
+		globalSlotIdx[entry.first] = globalSlots->vec.size();
+		globalSlots->vec.push_back(entry.second);
+	}
+}
+
+// Rewrites GLOBAL and MAKE_METHOD instructions into their slot-based variants,
+// so that they don't have to look up names at run time. Instructions referring
+// to unknown names are left alone, and will fail if they are ever executed.
+void VM::link(Chunk& chunk) {
+	if(chunk.isa == Isa::REGISTER) {
+		linkRegisters(chunk);
+		return;
+	}
+	
+	for(std::unique_ptr<FunctionChunk>& func : chunk.functions) {
+		auto it = func->code.begin();
+		while(it < func->code.end()) {
+			auto instr = it;
+			Opcode op = (Opcode) *it;
+			skipInstruction(it);
+			if(it > func->code.end()) break;
+			
+			auto operands = instr + 1;
+			int32_t slot;
+			Opcode linkedOp;
+			if(op == Opcode::GLOBAL) {
+				slot = findSlot(chunk, readUI16(operands));
+				linkedOp = Opcode::GLOBAL_SLOT;
+			} else if(op == Opcode::MAKE_METHOD || op == Opcode::CALL_METHOD) {
+				uint16_t nsConstantIdx = readUI16(operands);
+				slot = findSlot(chunk, nsConstantIdx, readUI16(operands));
+				linkedOp = op == Opcode::MAKE_METHOD ? Opcode::MAKE_METHOD_SLOT : Opcode::CALL_METHOD_SLOT;
+			} else {
+				continue;
+			}
+			if(slot == -1) continue;
+			
+			writeUI8(instr, (uint8_t) linkedOp);
+			writeUI16(instr, slot);
+		}
+	}
+}
+
+// Same as link(), for register code
+void VM::linkRegisters(Chunk& chunk) {
+	for(std::unique_ptr<FunctionChunk>& func : chunk.functions) {
+		auto it = func->code.begin();
+		while(it < func->code.end()) {
+			auto instr = it;
+			RegOpcode op = (RegOpcode) *it;
+			skipRegInstruction(it);
+			
+			// Names come after the destination or base register, and the receiver
+			auto names = instr + (op == RegOpcode::MAKE_METHOD ? 5 : 3);
+			auto operands = names;
+			int32_t slot;
+			RegOpcode linkedOp;
+			if(op == RegOpcode::GLOBAL) {
+				slot = findSlot(chunk, readUI16(operands));
+				linkedOp = RegOpcode::GLOBAL_SLOT;
+			} else if(op == RegOpcode::MAKE_METHOD || op == RegOpcode::CALL_METHOD) {
+				uint16_t nsConstantIdx = readUI16(operands);
+				slot = findSlot(chunk, nsConstantIdx, readUI16(operands));
+				linkedOp = op == RegOpcode::MAKE_METHOD ? RegOpcode::MAKE_METHOD_SLOT : RegOpcode::CALL_METHOD_SLOT;
+			} else {
+				continue;
+			}
+			if(slot == -1) continue;
+			
+			*instr = (uint8_t) linkedOp;
+			writeUI16(names, slot);
+		}
+	}
+}
+
+// Returns the global slot of a global, or of a method implementation, or -1 if there is none
+int32_t VM::findSlot(Chunk& chunk, uint16_t nameConstantIdx, int32_t methodConstantIdx) {
+	auto getName = [&](uint16_t constantIdx) -> std::string {
+		if(constantIdx >= chunk.constants->vec.size()) return "";
+		String* str = chunk.constants->vec[constantIdx].get<String>();
+		return str ? str->str : "";
+	};
+	
+	std::string name = getName(nameConstantIdx);
+	if(methodConstantIdx != -1)
+		name += "." + getName(methodConstantIdx);
+	auto slotIt = globalSlotIdx.find(name);
+	if(slotIt == globalSlotIdx.end()) return -1;
+	if(methodConstantIdx != -1 && !globalSlots->vec[slotIt->second].get<CFunction>()) return -1;
+	return slotIt->second;
 }
 
+// With GCC and Clang, use "labels as values" so that every handler ends with
+// its own indirect jump (threaded dispatch), which is much easier on the branch
+// predictor than a single shared switch. Define NO_COMPUTED_GOTO to force the
+// portable switch.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Define PROFILE_OPS to count the pairs of consecutive opcodes executed by the
+// interpreters, and list the most frequent ones at the end of the run. This is
+// what the superinstructions (see compiler/peephole.cpp) were chosen from.
+#ifdef PROFILE_OPS
+static uint64_t opPairCounts[256][256];
+static uint8_t prevOp = (uint8_t) Opcode::IGNORE;
+
+static void printOpPairs(Isa isa) {
+	auto desc = [&](uint8_t op) {
+		return isa == Isa::REGISTER ? regOpcodeDesc((RegOpcode) op) : opcodeDesc((Opcode) op);
+	};
+	uint64_t total = 0;
+	std::vector<std::tuple<uint64_t, uint8_t, uint8_t>> pairs;
+	for(int first = 0; first < 256; first++) {
+		for(int second = 0; second < 256; second++) {
+			if(opPairCounts[first][second])
+				pairs.emplace_back(opPairCounts[first][second], first, second);
+			total += opPairCounts[first][second];
+		}
+	}
+	std::sort(pairs.rbegin(), pairs.rend());
+	std::cout << total << " instructions executed. Most frequent opcode pairs:" << std::endl;
+	for(size_t i = 0; i < pairs.size() && i < 20; i++) {
+		auto [count, first, second] = pairs[i];
+		std::cout << count << "\t" << desc(first) << " " << desc(second) << std::endl;
+	}
+}
+	
+	#define PROFILE_OP() { opPairCounts[prevOp][PEEK_OP()]++; prevOp = PEEK_OP(); }
+#else
+	#define PROFILE_OP()
+#endif
+
+#ifdef COMPUTED_GOTO
+	#define TARGET(op) TARGET_##op:
+	#define TARGET_DEFAULT TARGET_UNKNOWN:
+	#define NEXT_OP() { PROFILE_OP() goto *dispatchTable[FETCH_OP()]; }
+	#define DISPATCH_LOOP NEXT_OP();
+	#define DISPATCH_LOOP_END
+#else
+	#define TARGET(op) case Op::op:
+	#define TARGET_DEFAULT default:
+	#define NEXT_OP() goto nextOp
+	#define DISPATCH_LOOP nextOp: PROFILE_OP() switch((Op) FETCH_OP()) {
+	#define DISPATCH_LOOP_END }
+#endif
+
+// Top-of-stack caching (define TOS_CACHE): the stack interpreter keeps the
+// stack top in 'sp', and the top value in 'tos' instead of memory, so that most
+// instructions don't touch the Stack object. SPILL() writes them back before
+// anything else looks at the stack (calls, compiled code, the GC), RELOAD()
+// reads them after the stack was changed. On errors the stack is left as last
+// spilled, as the GC only runs once spilled, its values are all still alive.
+// The slot under the top must exist for PUSH, so the interpreter puts a guard
+// value at the bottom of the stack.
+// It is not the default, as it is not a net win: it speeds up some loops, and
+// slows down others.
+#ifdef TOS_CACHE
+	#define PUSH(val) push(val)
+	#define POP() pop()
+	#define SPILL() (sp[-1] = tos, stack->top = sp)
+	#define RELOAD() (sp = stack->top, tos = sp[-1])
+	// Local writes must go to the cached value too, for the top local
+	#define SYNC_LOCAL(local) { if(&(local) == sp - 1) tos = (local); }
+#else
+	#define PUSH(val) stack->pushUnchecked(val)
+	#define POP() stack->popUnchecked()
+	#define SPILL()
+	#define RELOAD()
+	#define SYNC_LOCAL(local)
+#endif
+
+// The stack interpreter runs decoded code, where each function ends with a
+// return: there is no end of code to check for
+#define DISPATCH() { ip++; NEXT_OP(); }
+#define JUMP_IF(cond) { ip = (cond) ? ip->target : ip + 1; NEXT_OP(); }
+// Only instructions which may allocate need to give the GC a chance to run
+#define DISPATCH_GC() { SPILL(); GC::step(); DISPATCH(); }
+
+// Quickening: a generic binary instruction rewrites itself into the variant
+// specialized for the operand types it sees (with the generic instruction as
+// "real" variant if there is none). The c operand counts the times the site
+// turned back into the generic instruction, after a few it stays generic.
+const int32_t QUICKEN_MAX_MISSES = 4;
+#define QUICKEN(intOp, realOp) { \
+		if(ip->c < QUICKEN_MAX_MISSES) { \
+			if(left.isInt() && right.isInt()) ip->op = Opcode::intOp; \
+			else if(left.isReal() && right.isReal()) ip->op = Opcode::realOp; \
+		} \
+	}
+#define DEQUICKEN(genericOp, left, right) { \
+		ip->op = Opcode::genericOp; \
+		ip->c++; \
+		PUSH(left); \
+		PUSH(right); \
+		NEXT_OP(); \
+	}
+#define QUICK_BINARY(op, genericOp, guard, expr) \
+	TARGET(op) { \
+		Value right = POP(); \
+		Value left = POP(); \
+		if(!(guard)) DEQUICKEN(genericOp, left, right); \
+		PUSH(expr); \
+		DISPATCH(); \
+	}
+
+// Typed instructions run the generic operation if the tags don't match their guard
+#define TYPED_BINARY(op, guard, expr, genericExpr) \
+	TARGET(op) { \
+		Value right = POP(); \
+		Value left = POP(); \
+		if(guard) { \
+			PUSH(expr); \
+			DISPATCH(); \
+		} \
+		PUSH(genericExpr); \
+		DISPATCH_GC(); \
+	}
+
 void VM::run(Chunk& chunk) {
-	calls.emplace_back(new ExecutionRecord(0, 0));
+	if(!chunk.verified) throw ExecutionError("Cannot run bytecode which was not verified");
+	link(chunk);
+	jitCode.assign(chunk.functions.size(), nullptr);
+	callCounts.assign(chunk.functions.size(), 0);
+	if(chunk.isa == Isa::REGISTER) {
+		executeRegisters(chunk);
+	} else {
+		decoded = decodeChunk(chunk);
+		execute(chunk);
+	}
+	GC::collect();
+#ifdef PROFILE_OPS
+	printOpPairs(chunk.isa);
+#endif
+}
+
+
+// Opcode fetching for the dispatch macros
+#define PEEK_OP() (uint8_t) ip->op
+#define FETCH_OP() (uint8_t) ip->op
+
+// Verified bytecode can't over- or underflow the stack of a frame, nor refer to
+// invalid locals, upvalues or constants, so the interpreter doesn't check for
+// those, and only makes sure the stack has room for each function called.
+void VM::execute(Chunk& chunk) {
+	using Op = Opcode;
+#ifdef TOS_CACHE
+	stack->push(Value::nil()); // guard for the top-of-stack cache
+#endif
+	if(stack->size() + chunk.functions[0]->maxStack >= STACK_SIZE)
+		throw ExecutionError("Stack overflow");
+	calls->push(stack->size(), 0, nullptr);
+	
+#ifdef TOS_CACHE
+	Value* sp = stack->top;
+	Value tos = sp[-1];
+	auto push = [&](Value val) {
+		sp[-1] = tos;
+		sp++;
+		tos = val;
+	};
+	auto pop = [&]() {
+		Value val = tos;
+		sp--;
+		tos = sp[-1];
+		return val;
+	};
+#endif
 	
 	uint32_t funcIdx = 0;
-	auto it = chunk.functions[0]->code.begin();
-	bool returnNow = false;
-	while(calls.size() > 0) {
-		Opcode op = (Opcode) readUI8(it);
-		switch(op) {
-		case Opcode::IGNORE:
-			stack->pop();
-			break;
-		case Opcode::CONSTANT: {
-			uint16_t constantIdx = readUI16(it);
-			stack->push(chunk.constants->vec.at(constantIdx));
-			break;
-		} case Opcode::UNI_MINUS: {
-			Value val = stack->pop();
-			stack->push(val.negate());
-			break;
-		} case Opcode::BIN_PLUS: {
-			Value right = stack->pop();
-			Value left = stack->pop();
-			stack->push(left.plus(right));
-			break;
-		} case Opcode::BIN_MINUS: {
-			Value right = stack->pop();
-			Value left = stack->pop();
-			stack->push(left.minus(right));
-			break;
-		} case Opcode::MULTIPLY: {
-			Value right = stack->pop();
-			Value left = stack->pop();
-			stack->push(left.multiply(right));
-			break;
-		} case Opcode::DIVIDE: {
-			Value right = stack->pop();
-			Value left = stack->pop();
-			stack->push(left.divide(right));
-			break;
-		} case Opcode::MODULO: {
-			Value right = stack->pop();
-			Value left = stack->pop();
-			stack->push(left.modulo(right));
-			break;
-		} case Opcode::POWER: {
-			Value right = stack->pop();
-			Value left = stack->pop();
-			stack->push(left.power(right));
-			break;
-		} case Opcode::NOT: {
-			Value val = stack->pop();
+	Instruction* ip = decoded[0].code.data();
+	// Instructions run for compiled code are copied here, followed by a JIT_RESUME
+	Instruction step[2];
+	step[1].op = Opcode::JIT_RESUME;
+
+#ifdef COMPUTED_GOTO
+	#define LABEL(op) dispatchTable[(uint8_t) Op::op] = &&TARGET_##op;
+	std::array<void*, 256> dispatchTable;
+	dispatchTable.fill(&&TARGET_UNKNOWN);
+	LABEL(IGNORE) LABEL(CONSTANT) LABEL(UNI_MINUS)
+	LABEL(BIN_PLUS) LABEL(BIN_MINUS) LABEL(MULTIPLY) LABEL(DIVIDE) LABEL(MODULO)
+	LABEL(POWER)
+	LABEL(LET) LABEL(POP) LABEL(SET_LOCAL) LABEL(LOCAL)
+	LABEL(GLOBAL)
+	LABEL(NOT) LABEL(OR) LABEL(AND)
+	LABEL(EQUALS)
+	LABEL(LESS) LABEL(LESS_OR_EQ)
+	LABEL(JUMP_IF_NOT)
+	LABEL(JUMP)
+	LABEL(CALL) LABEL(RETURN)
+	LABEL(MAKE_FUNC) LABEL(MAKE_LIST) LABEL(MAKE_METHOD)
+	LABEL(INDEX)
+	LABEL(ADD_INT) LABEL(SUB_INT) LABEL(MUL_INT) LABEL(MOD_INT)
+	LABEL(ADD_REAL) LABEL(SUB_REAL) LABEL(MUL_REAL) LABEL(DIV_REAL) LABEL(MOD_REAL)
+	LABEL(EQUALS_INT)
+	LABEL(LESS_INT) LABEL(LESS_OR_EQ_INT)
+	LABEL(LESS_REAL) LABEL(LESS_OR_EQ_REAL)
+	LABEL(INDEX_LIST_INT)
+	LABEL(CALL_METHOD) LABEL(TAIL_CALL)
+	LABEL(LOCAL_LOCAL) LABEL(LOCAL_CONSTANT)
+	LABEL(INC_LOCAL) LABEL(ADD_INT_SET_LOCAL)
+	LABEL(JUMP_IF_NOT_LESS_INT) LABEL(JUMP_IF_NOT_LESS_OR_EQ_INT)
+	LABEL(JUMP_IF_NOT_LESS_LOCAL_LOCAL) LABEL(JUMP_IF_NOT_LESS_LOCAL_CONSTANT)
+	LABEL(GLOBAL_SLOT) LABEL(MAKE_METHOD_SLOT) LABEL(CALL_METHOD_SLOT)
+	LABEL(QUICK_PLUS_INT) LABEL(QUICK_PLUS_REAL) LABEL(QUICK_MINUS_INT) LABEL(QUICK_MINUS_REAL)
+	LABEL(QUICK_MULTIPLY_INT) LABEL(QUICK_MULTIPLY_REAL)
+	LABEL(QUICK_EQUALS_INT)
+	LABEL(QUICK_LESS_INT) LABEL(QUICK_LESS_REAL) LABEL(QUICK_LESS_OR_EQ_INT) LABEL(QUICK_LESS_OR_EQ_REAL)
+	LABEL(QUICK_INDEX_LIST)
+	LABEL(JIT_RESUME)
+	#undef LABEL
+#endif
+	
+	DISPATCH_LOOP
+		TARGET(IGNORE) {
+			POP();
+			DISPATCH();
+		} TARGET(CONSTANT) {
+			PUSH(ip->constant);
+			DISPATCH();
+		} TARGET(UNI_MINUS) {
+			Value val = POP();
+			PUSH(val.negate());
+			DISPATCH_GC();
+		} TARGET(BIN_PLUS) {
+			Value right = POP();
+			Value left = POP();
+			QUICKEN(QUICK_PLUS_INT, QUICK_PLUS_REAL);
+			PUSH(left.plus(right));
+			DISPATCH_GC();
+		} TARGET(BIN_MINUS) {
+			Value right = POP();
+			Value left = POP();
+			QUICKEN(QUICK_MINUS_INT, QUICK_MINUS_REAL);
+			PUSH(left.minus(right));
+			DISPATCH();
+		} TARGET(MULTIPLY) {
+			Value right = POP();
+			Value left = POP();
+			QUICKEN(QUICK_MULTIPLY_INT, QUICK_MULTIPLY_REAL);
+			PUSH(left.multiply(right));
+			DISPATCH();
+		} TARGET(DIVIDE) {
+			Value right = POP();
+			Value left = POP();
+			PUSH(left.divide(right));
+			DISPATCH();
+		} TARGET(MODULO) {
+			Value right = POP();
+			Value left = POP();
+			PUSH(left.modulo(right));
+			DISPATCH();
+		} TARGET(POWER) {
+			Value right = POP();
+			Value left = POP();
+			PUSH(left.power(right));
+			DISPATCH();
+		} TARGET(NOT) {
+			Value val = POP();
 			if(!val.isBool()) throw ExecutionError("Cannot 'not' non-boolean value " + val.toString());
-			stack->push(Value(!val.getBool()));
-			break;
-		} case Opcode::AND: {
-			Value right = stack->pop();
-			Value left = stack->pop();
+			PUSH(Value(!val.getBool()));
+			DISPATCH();
+		} TARGET(AND) {
+			Value right = POP();
+			Value left = POP();
 			if(!left.isBool() || !right.isBool()) throw ExecutionError("Cannot 'and' " + left.toString() + " and " + right.toString());
-			stack->push(Value(left.getBool() && right.getBool()));
-			break;
-		} case Opcode::OR: {
-			Value right = stack->pop();
-			Value left = stack->pop();
+			PUSH(Value(left.getBool() && right.getBool()));
+			DISPATCH();
+		} TARGET(OR) {
+			Value right = POP();
+			Value left = POP();
 			if(!left.isBool() || !right.isBool()) throw ExecutionError("Cannot 'or' " + left.toString() + " and " + right.toString());
-			stack->push(Value(left.getBool() || right.getBool()));
-			break;
-		} case Opcode::EQUALS: {
-			Value right = stack->pop();
-			Value left = stack->pop();
-			stack->push(Value(left.equals(right)));
-			break;
-		} case Opcode::LESS: {
-			Value right = stack->pop();
-			Value left = stack->pop();
-			stack->push(Value(left.less(right)));
-			break;
-		} case Opcode::LESS_OR_EQ: {
-			Value right = stack->pop();
-			Value left = stack->pop();
-			stack->push(Value(left.less_or_eq(right)));
-			break;
-		} case Opcode::LET: {
-			calls.back()->localCnt++;
-			break;
-		} case Opcode::POP: {
-			uint16_t amount = readUI16(it);
-			popLocals(amount);
-			break;
-		} case Opcode::SET_LOCAL: {
-			int16_t localIdx = readI16(it);
+			PUSH(Value(left.getBool() || right.getBool()));
+			DISPATCH();
+		} TARGET(EQUALS) {
+			Value right = POP();
+			Value left = POP();
+			QUICKEN(QUICK_EQUALS_INT, EQUALS);
+			PUSH(Value(left.equals(right)));
+			DISPATCH();
+		} TARGET(LESS) {
+			Value right = POP();
+			Value left = POP();
+			QUICKEN(QUICK_LESS_INT, QUICK_LESS_REAL);
+			PUSH(Value(left.less(right)));
+			DISPATCH();
+		} TARGET(LESS_OR_EQ) {
+			Value right = POP();
+			Value left = POP();
+			QUICKEN(QUICK_LESS_OR_EQ_INT, QUICK_LESS_OR_EQ_REAL);
+			PUSH(Value(left.less_or_eq(right)));
+			DISPATCH();
+		} TARGET(LET) {
+			calls->back().localCnt++;
+			SPILL(); // the top value becomes a local
+			DISPATCH();
+		} TARGET(POP) {
+			SPILL();
+			popLocals(ip->a);
+			RELOAD();
+			DISPATCH();
+		} TARGET(SET_LOCAL) {
+			int16_t localIdx = ip->a;
 			if(localIdx >= 0) {
-				getLocal(localIdx) = stack->pop();
+				Value val = POP();
+				Value& local = getLocal(localIdx);
+				local = val;
+				SYNC_LOCAL(local);
 			} else {
-				getUpvalue(localIdx).resolve() = stack->pop();
+				Upvalue& upvalue = getUpvalue(localIdx);
+				upvalue.set(POP());
+				SYNC_LOCAL(upvalue.resolve()); // may be an open upvalue of a caller
 			}
-			break;
-		} case Opcode::LOCAL: {
-			int16_t localIdx = readI16(it);
+			DISPATCH();
+		} TARGET(LOCAL) {
+			int16_t localIdx = ip->a;
 			if(localIdx >= 0) {
-				stack->push(getLocal(localIdx));
+				PUSH(getLocal(localIdx));
 			} else {
-				stack->push(getUpvalue(localIdx).resolve());
+				PUSH(getUpvalue(localIdx).resolve());
 			}
-			break;
-		} case Opcode::GLOBAL: {
-			stack->push(getGlobal(chunk, readUI16(it)));
-			break;
-		} case Opcode::JUMP_IF_NOT: {
-			Value cond = stack->pop();
-			int16_t relJump = readI16(it);
+			DISPATCH();
+		} TARGET(GLOBAL) {
+			PUSH(getGlobal(chunk, ip->a));
+			DISPATCH();
+		} TARGET(GLOBAL_SLOT) {
+			PUSH(getGlobalSlot(ip->a));
+			DISPATCH();
+		} TARGET(JUMP_IF_NOT) {
+			Value cond = POP();
 			if(!cond.isBool()) throw ExecutionError("Expected boolean in 'if' condition, got " + cond.toString());
-			if(!cond.getBool())
-				it += relJump;
-			break;
-		} case Opcode::JUMP:
-			it += readI16(it);
-			break;
-		case Opcode::CALL: {
-			uint16_t argCnt = readUI16(it);
+			JUMP_IF(!cond.getBool());
+		} TARGET(JUMP) {
+			ip = ip->target;
+			NEXT_OP();
+		} TARGET(CALL) {
+			uint16_t argCnt = ip->a;
 			
-			Value funcValue = stack->pop();
+			Value funcValue = POP();
 			
-			Method* method;
-			CFunction* cfunc;
 			Function* func;
-			if((method = funcValue.get<Method>()) || (cfunc = funcValue.get<CFunction>())) {
-				std::vector<Value> args;
-				if(method) {
-					args.push_back(method->self);
-					cfunc = method->function;
-				}
-				// Pop the arguments off the stack
-				stack->popN(args, argCnt);
-				Value res = cfunc->func(args);
-				stack->push(res);
-			} else if(func = funcValue.get<Function>()) {
+			if(func = funcValue.get<Function>()) {
 				// We leave the arguments on the stack, they will become locals
 				if(argCnt != func->argCnt)
 					throw ExecutionError("Expected " + std::to_string(func->argCnt) + " arguments, got " + std::to_string(argCnt));
 				
-				calls.back()->funcIdx = funcIdx;
-				calls.back()->codeOffset = it - chunk.functions[funcIdx]->code.begin();
+				calls->back().funcIdx = funcIdx;
+				calls->back().codeOffset = ip - decoded[funcIdx].code.data();
 				
+				SPILL();
 				funcIdx = func->protoIdx;
-				calls.emplace_back(new ExecutionRecord(stack->size() - argCnt, argCnt, func));
-				it = chunk.functions[funcIdx]->code.begin();
-			} else {
+				uint32_t localBase = stack->size() - argCnt;
+				if(localBase + chunk.functions[funcIdx]->maxStack >= STACK_SIZE)
+					throw ExecutionError("Stack overflow");
+				calls->push(localBase, argCnt, func);
+				if(useJit(chunk, funcIdx)) goto enterJit;
+				ip = decoded[funcIdx].code.data();
+				GC::step();
+				NEXT_OP();
+			}
+			SPILL();
+			if(!tryCallNative(funcValue, argCnt))
 				throw ExecutionError("Cannot call " + funcValue.getTypeDesc());
+			RELOAD();
+			DISPATCH_GC();
+		} TARGET(TAIL_CALL) {
+			uint16_t argCnt = ip->a;
+			
+			Value funcValue = POP();
+			
+			Function* func;
+			if(func = funcValue.get<Function>()) {
+				if(argCnt != func->argCnt)
+					throw ExecutionError("Expected " + std::to_string(func->argCnt) + " arguments, got " + std::to_string(argCnt));
+				SPILL();
+				
+				// Reuse the current frame: discard its locals, and move the arguments in their place
+				ExecutionRecord& record = calls->back();
+				Value* localBase = &stack->array[record.localBase];
+				calls->closeUpvalues(localBase);
+				std::copy(stack->end() - argCnt, stack->end(), localBase);
+				stack->removeN(stack->size() - record.localBase - argCnt);
+				record.localCnt = argCnt;
+				record.func = func;
+				record.jitResume = nullptr;
+				
+				funcIdx = func->protoIdx;
+				if(record.localBase + chunk.functions[funcIdx]->maxStack >= STACK_SIZE)
+					throw ExecutionError("Stack overflow");
+				RELOAD();
+				if(useJit(chunk, funcIdx)) goto enterJit;
+				ip = decoded[funcIdx].code.data();
+				NEXT_OP();
 			}
-			break;
-		} case Opcode::RETURN: {
-			Value val = stack->pop();
-			popLocals(calls.back()->localCnt);
-			stack->push(val); // Push return value
-			returnNow = true;
-			break;
-		} case Opcode::MAKE_FUNC: {
-			uint16_t protoIdx = readUI16(it);
-			uint16_t argCnt = readUI16(it);
-			uint16_t upvalueCnt = readUI16(it);
-			Function* func = new Function(protoIdx, argCnt, upvalueCnt);
+			SPILL();
+			if(!tryCallNative(funcValue, argCnt))
+				throw ExecutionError("Cannot call " + funcValue.getTypeDesc());
+			// Natives don't get a frame: just return their result
+			GC::step();
+			RELOAD();
+			goto returnValue;
+		} TARGET(RETURN)
+		returnValue: {
+			Value val = POP();
+			SPILL();
+			popLocals(calls->back().localCnt);
+			RELOAD();
+			PUSH(val); // Push return value
+			goto doReturn;
+		} TARGET(MAKE_FUNC) {
+			uint16_t upvalueCnt = ip->c;
+			Function* func = new Function(ip->a, ip->b, upvalueCnt);
 			for(uint16_t i = 0; i < upvalueCnt; i++) {
-				int16_t idx = readI16(it);
-				ExecutionRecord& record = *calls.back();
+				int16_t idx = ip->upvalues[i];
+				ExecutionRecord& record = calls->back();
 				if(idx >= 0) {
-					auto it = record.upvalueBackPointers.find(idx);
-					if(it != record.upvalueBackPointers.end()) {
-						func->upvalues[i] = it->second;
+					Value* value;
+					if(idx == record.localCnt) { // recursive call (hopefully)
+						value = &stack->array[record.localBase + idx];
 					} else {
-						Value* value;
-						if(idx == record.localCnt) { // recursive call (hopefully)
-							value = &stack->array[record.localBase + idx];
-						} else {
-							value = &getLocal(idx);
-						}
-						Upvalue* upvalue = new Upvalue(value, &record, idx);
-						record.upvalueBackPointers[idx] = upvalue;
-						func->upvalues[i] = upvalue;
+						value = &getLocal(idx);
 					}
+					func->upvalues[i] = calls->captureUpvalue(value);
 				} else {
 					func->upvalues[i] = &getUpvalue(idx);
 				}
 			}
-			stack->push(Value(func));
-			break;
-		} case Opcode::MAKE_LIST: {
-			uint16_t valueCnt = readUI16(it);
+			PUSH(Value(func));
+			DISPATCH_GC();
+		} TARGET(MAKE_LIST) {
 			std::vector<Value> vals;
-			stack->popN(vals, valueCnt);
-			stack->push(Value(new List(std::move(vals))));
-			break;
-		} case Opcode::INDEX: {
-			Value index = stack->pop();
-			Value listValue = stack->pop();
+			SPILL();
+			stack->popN(vals, ip->a);
+			RELOAD();
+			PUSH(Value(new List(std::move(vals))));
+			DISPATCH_GC();
+		} TARGET(INDEX) {
+			Value index = POP();
+			Value listValue = POP();
 			List* list = listValue.get<List>();
+			if(list && index.isInt() && ip->c < QUICKEN_MAX_MISSES)
+				ip->op = Opcode::QUICK_INDEX_LIST;
 			if(!list)
 				throw ExecutionError("Cannot index " + listValue.getTypeDesc());
 			if(!index.isInt())
@@ -231,74 +645,567 @@ void VM::run(Chunk& chunk) {
 			int32_t index2 = index.getInt();
 			if(index2 < 1 || index2 > list->vec.size())
 				throw ExecutionError("List index out of range: " + std::to_string(index2));
-			stack->push(list->vec[index2-1]);
-			break;
-		} case Opcode::MAKE_METHOD: {
-			Value self = stack->pop();
-			Value nsValue = getGlobal(chunk, readUI16(it));
-			Namespace* ns = nsValue.get<Namespace>();
-			if(!ns) throw ExecutionError("Tring to get method from non-namespace " + nsValue.toString());
-			std::string prop = getStringOperand(chunk, readUI16(it));
-			auto it = ns->map.find(prop);
-			if(it == ns->map.end()) throw ExecutionError("Cannot find implementation for method '" + prop + "'");
-			CFunction* impl = it->second.get<CFunction>();
+			PUSH(list->vec[index2-1]);
+			DISPATCH();
+		} TARGET(MAKE_METHOD) {
+			Value self = POP();
+			CFunction* impl = getMethod(chunk, ip->a, ip->b);
+			PUSH(Value(new Method(self, impl)));
+			DISPATCH_GC();
+		} TARGET(MAKE_METHOD_SLOT) {
+			Value self = POP();
+			Value implValue = getGlobalSlot(ip->a); // b: method name, only kept for listings
+			CFunction* impl = implValue.get<CFunction>();
+			if(!impl) throw ExecutionError("Method implementation is not a CFunction");
+			PUSH(Value(new Method(self, impl)));
+			DISPATCH_GC();
+		} TARGET(CALL_METHOD) {
+			CFunction* impl = getMethod(chunk, ip->a, ip->b);
+			SPILL();
+			callNative(impl, ip->c + 1);
+			RELOAD();
+			DISPATCH_GC();
+		} TARGET(CALL_METHOD_SLOT) {
+			Value implValue = getGlobalSlot(ip->a); // b: method name, only kept for listings
+			CFunction* impl = implValue.get<CFunction>();
 			if(!impl) throw ExecutionError("Method implementation is not a CFunction");
-			stack->push(Value(new Method(self, impl)));
-			break;
-		} default:
-			throw ExecutionError("Opcode " + opcodeDesc(op) + " not yet implemented");
+			SPILL();
+			callNative(impl, ip->c + 1);
+			RELOAD();
+			DISPATCH_GC();
 		}
 		
-		if(!returnNow && it == chunk.functions[funcIdx]->code.end()) { // implicit "return nil"
-			popLocals(calls.back()->localCnt);
-			stack->push(Value::nil());
-			returnNow = true;
+		// The compiler emits these for the static types of the operands, which
+		// don't prove their kinds at run time (a list may hold any value), so
+		// they check the tags, and fall back to the generic operation. Values
+		// typed as real may also be ints (eg. int arguments), which it handles.
+		TYPED_BINARY(ADD_INT, left.isInt() && right.isInt(), Value(left.getInt() + right.getInt()), left.plus(right))
+		TYPED_BINARY(SUB_INT, left.isInt() && right.isInt(), Value(left.getInt() - right.getInt()), left.minus(right))
+		TYPED_BINARY(MUL_INT, left.isInt() && right.isInt(), Value(left.getInt() * right.getInt()), left.multiply(right))
+		TYPED_BINARY(MOD_INT, left.isInt() && right.isInt(), Value(left.getInt() % right.getInt()), left.modulo(right))
+		TYPED_BINARY(ADD_REAL, left.isReal() && right.isReal(), Value(left.getReal() + right.getReal()), left.plus(right))
+		TYPED_BINARY(SUB_REAL, left.isReal() && right.isReal(), Value(left.getReal() - right.getReal()), left.minus(right))
+		TYPED_BINARY(MUL_REAL, left.isReal() && right.isReal(), Value(left.getReal() * right.getReal()), left.multiply(right))
+		TYPED_BINARY(DIV_REAL, left.isNumeric() && right.isReal() && right.getReal() != 0.0,
+			Value(left.convertToDouble() / right.getReal()), left.divide(right))
+		TYPED_BINARY(MOD_REAL, left.isReal() && right.isReal(), Value(fmod(left.getReal(), right.getReal())), left.modulo(right))
+		TYPED_BINARY(EQUALS_INT, left.isInt() && right.isInt(), Value(left.getInt() == right.getInt()), Value(left.equals(right)))
+		TYPED_BINARY(LESS_INT, left.isInt() && right.isInt(), Value(left.getInt() < right.getInt()), Value(left.less(right)))
+		TYPED_BINARY(LESS_OR_EQ_INT, left.isInt() && right.isInt(), Value(left.getInt() <= right.getInt()), Value(left.less_or_eq(right)))
+		TYPED_BINARY(LESS_REAL, left.isNumeric() && right.isNumeric(),
+			Value(left.convertToDouble() < right.convertToDouble()), Value(left.less(right)))
+		TYPED_BINARY(LESS_OR_EQ_REAL, left.isNumeric() && right.isNumeric(),
+			Value(left.convertToDouble() <= right.convertToDouble()), Value(left.less_or_eq(right)))
+		TARGET(INDEX_LIST_INT) {
+			Value index = POP();
+			Value listValue = POP();
+			List* list = listValue.get<List>();
+			if(!list)
+				throw ExecutionError("Cannot index " + listValue.getTypeDesc());
+			if(!index.isInt())
+				throw ExecutionError("Cannot index list with " + index.getTypeDesc());
+			int32_t index2 = index.getInt();
+			if(index2 < 1 || index2 > list->vec.size())
+				throw ExecutionError("List index out of range: " + std::to_string(index2));
+			PUSH(list->vec[index2-1]);
+			DISPATCH();
 		}
 		
-		if(returnNow) {
-			returnNow = false;
-			uint32_t leftOnStack = stack->size() - calls.back()->localBase;
-			if(leftOnStack != 1)
-				throw ExecutionError("Unexpected number of values on stack at the end of function: " + std::to_string(leftOnStack));
-			calls.pop_back();
-			
-			if(calls.size() == 0) { // we just exited the main function
-				break;
-			} else {
-				funcIdx = calls.back()->funcIdx;
-				it = chunk.functions[funcIdx]->code.begin() + calls.back()->codeOffset;
+		// Superinstructions: like the sequences they replace, they only access
+		// locals (not upvalues), and check the tags of their int operands.
+		TARGET(LOCAL_LOCAL) {
+			PUSH(getLocal(ip->a));
+			PUSH(getLocal(ip->b));
+			DISPATCH();
+		} TARGET(LOCAL_CONSTANT) {
+			PUSH(getLocal(ip->a));
+			PUSH(ip->constant);
+			DISPATCH();
+		} TARGET(INC_LOCAL) {
+			Value& local = getLocal(ip->a);
+			if(local.isInt()) {
+				local = Value(local.getInt() + ip->b);
+				SYNC_LOCAL(local);
+				DISPATCH();
+			}
+			local = local.plus(Value(ip->b));
+			SYNC_LOCAL(local);
+			DISPATCH_GC();
+		} TARGET(ADD_INT_SET_LOCAL) {
+			Value right = POP();
+			Value left = POP();
+			Value& local = getLocal(ip->a);
+			if(left.isInt() && right.isInt()) {
+				local = Value(left.getInt() + right.getInt());
+				SYNC_LOCAL(local);
+				DISPATCH();
 			}
+			local = left.plus(right);
+			SYNC_LOCAL(local);
+			DISPATCH_GC();
+		} TARGET(JUMP_IF_NOT_LESS_INT) {
+			Value right = POP();
+			Value left = POP();
+			JUMP_IF(left.isInt() && right.isInt() ? !(left.getInt() < right.getInt()) : !left.less(right));
+		} TARGET(JUMP_IF_NOT_LESS_OR_EQ_INT) {
+			Value right = POP();
+			Value left = POP();
+			JUMP_IF(left.isInt() && right.isInt() ? !(left.getInt() <= right.getInt()) : !left.less_or_eq(right));
+		} TARGET(JUMP_IF_NOT_LESS_LOCAL_LOCAL) {
+			Value left = getLocal(ip->a);
+			Value right = getLocal(ip->b);
+			JUMP_IF(left.isInt() && right.isInt() ? !(left.getInt() < right.getInt()) : !left.less(right));
+		} TARGET(JUMP_IF_NOT_LESS_LOCAL_CONSTANT) {
+			Value left = getLocal(ip->a);
+			JUMP_IF(left.isInt() ? !(left.getInt() < ip->b) : !left.less(Value(ip->b)));
 		}
 		
-		GC::step();
+		// Quickened instructions, which generic ones rewrite themselves into
+		// after seeing the types of their operands. If their guard fails, they
+		// turn back into the generic instruction, and run it.
+		QUICK_BINARY(QUICK_PLUS_INT, BIN_PLUS, left.isInt() && right.isInt(), Value(left.getInt() + right.getInt()))
+		QUICK_BINARY(QUICK_PLUS_REAL, BIN_PLUS, left.isReal() && right.isReal(), Value(left.getReal() + right.getReal()))
+		QUICK_BINARY(QUICK_MINUS_INT, BIN_MINUS, left.isInt() && right.isInt(), Value(left.getInt() - right.getInt()))
+		QUICK_BINARY(QUICK_MINUS_REAL, BIN_MINUS, left.isReal() && right.isReal(), Value(left.getReal() - right.getReal()))
+		QUICK_BINARY(QUICK_MULTIPLY_INT, MULTIPLY, left.isInt() && right.isInt(), Value(left.getInt() * right.getInt()))
+		QUICK_BINARY(QUICK_MULTIPLY_REAL, MULTIPLY, left.isReal() && right.isReal(), Value(left.getReal() * right.getReal()))
+		QUICK_BINARY(QUICK_EQUALS_INT, EQUALS, left.isInt() && right.isInt(), Value(left.getInt() == right.getInt()))
+		QUICK_BINARY(QUICK_LESS_INT, LESS, left.isInt() && right.isInt(), Value(left.getInt() < right.getInt()))
+		QUICK_BINARY(QUICK_LESS_REAL, LESS, left.isReal() && right.isReal(), Value(left.getReal() < right.getReal()))
+		QUICK_BINARY(QUICK_LESS_OR_EQ_INT, LESS_OR_EQ, left.isInt() && right.isInt(), Value(left.getInt() <= right.getInt()))
+		QUICK_BINARY(QUICK_LESS_OR_EQ_REAL, LESS_OR_EQ, left.isReal() && right.isReal(), Value(left.getReal() <= right.getReal()))
+		TARGET(QUICK_INDEX_LIST) {
+			Value index = POP();
+			Value listValue = POP();
+			List* list = listValue.get<List>();
+			if(!list || !index.isInt()) {
+				DEQUICKEN(INDEX, listValue, index);
+			}
+			int32_t index2 = index.getInt();
+			if(index2 < 1 || index2 > list->vec.size())
+				throw ExecutionError("List index out of range: " + std::to_string(index2));
+			PUSH(list->vec[index2-1]);
+			DISPATCH();
+		} TARGET(JIT_RESUME) {
+			goto enterJit;
+		} TARGET_DEFAULT {
+			throw ExecutionError("Opcode " + opcodeDesc(ip->op) + " not yet implemented");
+		}
+	DISPATCH_LOOP_END
+
+enterJit: {
+		ExecutionRecord& record = calls->back();
+		const void* resume = record.jitResume;
+		record.jitResume = nullptr;
+		SPILL();
+		uint32_t offset = jitCode[funcIdx](&stack->top, &stack->array[record.localBase], &record, resume);
+		RELOAD();
+		// Execute the instruction the compiled code stopped at, then go back to it.
+		// It is never a jump, so it can run from a copy. Without a resume point,
+		// the rest of the frame is interpreted.
+		ip = decoded[funcIdx].code.data() + decoded[funcIdx].instrIdx[offset];
+		if(record.jitResume) {
+			step[0] = *ip;
+			ip = step;
+		}
+		NEXT_OP();
+	}
+
+doReturn: {
+		SPILL();
+		calls->pop();
+		
+		if(calls->size() > 0) {
+			funcIdx = calls->back().funcIdx;
+			if(calls->back().jitResume) goto enterJit;
+			ip = decoded[funcIdx].code.data() + calls->back().codeOffset;
+			DISPATCH();
+		}
+		// else, we just exited the main function
 	}
+}
+
+#undef PEEK_OP
+#undef FETCH_OP
+#define PEEK_OP() *it
+#define FETCH_OP() readUI8(it)
+
+// Register code is translated from verified stack code, so it runs unchecked
+// too. Each frame holds maxStack registers, which are cleared on entry, as the
+// GC marks the stack up to its top.
+void VM::executeRegisters(Chunk& chunk) {
+	using Op = RegOpcode;
+	Value* constants = chunk.constants->vec.data();
 	
-	GC::collect();
+	uint32_t funcIdx = 0;
+	Value* base = stack->end();
+	std::vector<uint8_t>::iterator it;
+	Value result = Value::nil();
+	
+	auto enterFrame = [&](uint16_t argCnt) {
+		uint32_t maxStack = chunk.functions[funcIdx]->maxStack;
+		if(base + maxStack >= stack->begin() + STACK_SIZE)
+			throw ExecutionError("Stack overflow");
+		std::fill(base + argCnt, base + maxStack, Value::nil());
+		stack->top = base + maxStack;
+		it = chunk.functions[funcIdx]->code.begin();
+	};
+	auto rk = [&](uint16_t operand) {
+		return operand & RK_CONSTANT ? constants[operand & ~RK_CONSTANT] : base[operand];
+	};
+	
+	calls->push(stack->size(), 0, nullptr);
+	enterFrame(0);
+
+#ifdef COMPUTED_GOTO
+	#define LABEL(op) dispatchTable[(uint8_t) Op::op] = &&TARGET_##op;
+	std::array<void*, 256> dispatchTable;
+	dispatchTable.fill(&&TARGET_UNKNOWN);
+	LABEL(MOVE) LABEL(LOADK) LABEL(GET_UPVALUE) LABEL(SET_UPVALUE) LABEL(GLOBAL)
+	LABEL(NEG) LABEL(NOT)
+	LABEL(PLUS) LABEL(MINUS) LABEL(MULTIPLY) LABEL(DIVIDE) LABEL(MODULO) LABEL(POWER)
+	LABEL(OR) LABEL(AND)
+	LABEL(EQUALS) LABEL(LESS) LABEL(LESS_OR_EQ)
+	LABEL(INDEX)
+	LABEL(ADD_INT) LABEL(SUB_INT) LABEL(MUL_INT) LABEL(MOD_INT)
+	LABEL(ADD_REAL) LABEL(SUB_REAL) LABEL(MUL_REAL) LABEL(DIV_REAL) LABEL(MOD_REAL)
+	LABEL(EQUALS_INT)
+	LABEL(LESS_INT) LABEL(LESS_OR_EQ_INT)
+	LABEL(LESS_REAL) LABEL(LESS_OR_EQ_REAL)
+	LABEL(INDEX_LIST_INT)
+	LABEL(JUMP) LABEL(JUMP_IF_NOT)
+	LABEL(JUMP_IF_NOT_LESS_INT) LABEL(JUMP_IF_NOT_LESS_OR_EQ_INT)
+	LABEL(CALL) LABEL(TAIL_CALL) LABEL(CALL_METHOD)
+	LABEL(RETURN) LABEL(RETURN_NIL) LABEL(CLOSE)
+	LABEL(MAKE_FUNC) LABEL(MAKE_LIST) LABEL(MAKE_METHOD)
+	LABEL(GLOBAL_SLOT) LABEL(CALL_METHOD_SLOT) LABEL(MAKE_METHOD_SLOT)
+	#undef LABEL
+#endif
+	
+	// A RK RK
+	#define BINARY_OP(op, expr) \
+		TARGET(op) { \
+			Value& dst = base[readUI16(it)]; \
+			Value left = rk(readUI16(it)); \
+			Value right = rk(readUI16(it)); \
+			dst = expr; \
+			NEXT_OP(); \
+		}
+	// A RK RK, running the generic operation if the tags don't match the guard
+	#define TYPED_OP(op, guard, expr, genericExpr) \
+		TARGET(op) { \
+			Value& dst = base[readUI16(it)]; \
+			Value left = rk(readUI16(it)); \
+			Value right = rk(readUI16(it)); \
+			if(guard) { \
+				dst = expr; \
+				NEXT_OP(); \
+			} \
+			dst = genericExpr; \
+			GC::step(); \
+			NEXT_OP(); \
+		}
+	
+	DISPATCH_LOOP
+		TARGET(MOVE) {
+			Value& dst = base[readUI16(it)];
+			dst = rk(readUI16(it));
+			NEXT_OP();
+		} TARGET(LOADK) {
+			Value& dst = base[readUI16(it)];
+			dst = constants[readUI16(it)];
+			NEXT_OP();
+		} TARGET(GET_UPVALUE) {
+			Value& dst = base[readUI16(it)];
+			dst = calls->back().func->upvalues[readUI16(it)]->resolve();
+			NEXT_OP();
+		} TARGET(SET_UPVALUE) {
+			Upvalue* upvalue = calls->back().func->upvalues[readUI16(it)];
+			upvalue->set(rk(readUI16(it)));
+			NEXT_OP();
+		} TARGET(GLOBAL) {
+			Value& dst = base[readUI16(it)];
+			dst = getGlobal(chunk, readUI16(it));
+			NEXT_OP();
+		} TARGET(GLOBAL_SLOT) {
+			Value& dst = base[readUI16(it)];
+			dst = getGlobalSlot(readUI16(it));
+			NEXT_OP();
+		} TARGET(NEG) {
+			Value& dst = base[readUI16(it)];
+			dst = rk(readUI16(it)).negate();
+			GC::step();
+			NEXT_OP();
+		} TARGET(NOT) {
+			Value& dst = base[readUI16(it)];
+			Value val = rk(readUI16(it));
+			if(!val.isBool()) throw ExecutionError("Cannot 'not' non-boolean value " + val.toString());
+			dst = Value(!val.getBool());
+			NEXT_OP();
+		} TARGET(PLUS) {
+			Value& dst = base[readUI16(it)];
+			Value left = rk(readUI16(it));
+			Value right = rk(readUI16(it));
+			dst = left.plus(right);
+			GC::step();
+			NEXT_OP();
+		}
+		BINARY_OP(MINUS, left.minus(right))
+		BINARY_OP(MULTIPLY, left.multiply(right))
+		BINARY_OP(DIVIDE, left.divide(right))
+		BINARY_OP(MODULO, left.modulo(right))
+		BINARY_OP(POWER, left.power(right))
+		TARGET(AND) {
+			Value& dst = base[readUI16(it)];
+			Value left = rk(readUI16(it));
+			Value right = rk(readUI16(it));
+			if(!left.isBool() || !right.isBool()) throw ExecutionError("Cannot 'and' " + left.toString() + " and " + right.toString());
+			dst = Value(left.getBool() && right.getBool());
+			NEXT_OP();
+		} TARGET(OR) {
+			Value& dst = base[readUI16(it)];
+			Value left = rk(readUI16(it));
+			Value right = rk(readUI16(it));
+			if(!left.isBool() || !right.isBool()) throw ExecutionError("Cannot 'or' " + left.toString() + " and " + right.toString());
+			dst = Value(left.getBool() || right.getBool());
+			NEXT_OP();
+		}
+		BINARY_OP(EQUALS, Value(left.equals(right)))
+		BINARY_OP(LESS, Value(left.less(right)))
+		BINARY_OP(LESS_OR_EQ, Value(left.less_or_eq(right)))
+		TARGET(INDEX) {
+			Value& dst = base[readUI16(it)];
+			Value listValue = rk(readUI16(it));
+			Value index = rk(readUI16(it));
+			List* list = listValue.get<List>();
+			if(!list)
+				throw ExecutionError("Cannot index " + listValue.getTypeDesc());
+			if(!index.isInt())
+				throw ExecutionError("Cannot index list with " + index.getTypeDesc());
+			int32_t index2 = index.getInt();
+			if(index2 < 1 || index2 > list->vec.size())
+				throw ExecutionError("List index out of range: " + std::to_string(index2));
+			dst = list->vec[index2-1];
+			NEXT_OP();
+		}
+		TYPED_OP(ADD_INT, left.isInt() && right.isInt(), Value(left.getInt() + right.getInt()), left.plus(right))
+		TYPED_OP(SUB_INT, left.isInt() && right.isInt(), Value(left.getInt() - right.getInt()), left.minus(right))
+		TYPED_OP(MUL_INT, left.isInt() && right.isInt(), Value(left.getInt() * right.getInt()), left.multiply(right))
+		TYPED_OP(MOD_INT, left.isInt() && right.isInt(), Value(left.getInt() % right.getInt()), left.modulo(right))
+		TYPED_OP(ADD_REAL, left.isReal() && right.isReal(), Value(left.getReal() + right.getReal()), left.plus(right))
+		TYPED_OP(SUB_REAL, left.isReal() && right.isReal(), Value(left.getReal() - right.getReal()), left.minus(right))
+		TYPED_OP(MUL_REAL, left.isReal() && right.isReal(), Value(left.getReal() * right.getReal()), left.multiply(right))
+		TYPED_OP(DIV_REAL, left.isNumeric() && right.isReal() && right.getReal() != 0.0,
+			Value(left.convertToDouble() / right.getReal()), left.divide(right))
+		TYPED_OP(MOD_REAL, left.isReal() && right.isReal(), Value(fmod(left.getReal(), right.getReal())), left.modulo(right))
+		TYPED_OP(EQUALS_INT, left.isInt() && right.isInt(), Value(left.getInt() == right.getInt()), Value(left.equals(right)))
+		TYPED_OP(LESS_INT, left.isInt() && right.isInt(), Value(left.getInt() < right.getInt()), Value(left.less(right)))
+		TYPED_OP(LESS_OR_EQ_INT, left.isInt() && right.isInt(), Value(left.getInt() <= right.getInt()), Value(left.less_or_eq(right)))
+		TYPED_OP(LESS_REAL, left.isNumeric() && right.isNumeric(),
+			Value(left.convertToDouble() < right.convertToDouble()), Value(left.less(right)))
+		TYPED_OP(LESS_OR_EQ_REAL, left.isNumeric() && right.isNumeric(),
+			Value(left.convertToDouble() <= right.convertToDouble()), Value(left.less_or_eq(right)))
+		TARGET(INDEX_LIST_INT) {
+			Value& dst = base[readUI16(it)];
+			Value listValue = rk(readUI16(it));
+			Value index = rk(readUI16(it));
+			List* list = listValue.get<List>();
+			if(!list)
+				throw ExecutionError("Cannot index " + listValue.getTypeDesc());
+			if(!index.isInt())
+				throw ExecutionError("Cannot index list with " + index.getTypeDesc());
+			int32_t index2 = index.getInt();
+			if(index2 < 1 || index2 > list->vec.size())
+				throw ExecutionError("List index out of range: " + std::to_string(index2));
+			dst = list->vec[index2-1];
+			NEXT_OP();
+		} TARGET(JUMP) {
+			it += readI16(it);
+			NEXT_OP();
+		} TARGET(JUMP_IF_NOT) {
+			Value cond = rk(readUI16(it));
+			int16_t relJump = readI16(it);
+			if(!cond.isBool()) throw ExecutionError("Expected boolean in 'if' condition, got " + cond.toString());
+			if(!cond.getBool())
+				it += relJump;
+			NEXT_OP();
+		} TARGET(JUMP_IF_NOT_LESS_INT) {
+			Value left = rk(readUI16(it));
+			Value right = rk(readUI16(it));
+			int16_t relJump = readI16(it);
+			if(left.isInt() && right.isInt() ? !(left.getInt() < right.getInt()) : !left.less(right))
+				it += relJump;
+			NEXT_OP();
+		} TARGET(JUMP_IF_NOT_LESS_OR_EQ_INT) {
+			Value left = rk(readUI16(it));
+			Value right = rk(readUI16(it));
+			int16_t relJump = readI16(it);
+			if(left.isInt() && right.isInt() ? !(left.getInt() <= right.getInt()) : !left.less_or_eq(right))
+				it += relJump;
+			NEXT_OP();
+		} TARGET(CALL) {
+			uint16_t callBase = readUI16(it);
+			uint16_t argCnt = readUI16(it);
+			Value funcValue = base[callBase + argCnt];
+			
+			Function* func;
+			if(func = funcValue.get<Function>()) {
+				if(argCnt != func->argCnt)
+					throw ExecutionError("Expected " + std::to_string(func->argCnt) + " arguments, got " + std::to_string(argCnt));
+				
+				calls->back().funcIdx = funcIdx;
+				calls->back().codeOffset = it - chunk.functions[funcIdx]->code.begin();
+				
+				base += callBase;
+				funcIdx = func->protoIdx;
+				calls->push(base - stack->begin(), argCnt, func);
+				enterFrame(argCnt);
+			} else {
+				base[callBase] = callNativeAt(funcValue, base + callBase, argCnt);
+			}
+			GC::step();
+			NEXT_OP();
+		} TARGET(TAIL_CALL) {
+			uint16_t callBase = readUI16(it);
+			uint16_t argCnt = readUI16(it);
+			Value funcValue = base[callBase + argCnt];
+			
+			Function* func;
+			if(func = funcValue.get<Function>()) {
+				if(argCnt != func->argCnt)
+					throw ExecutionError("Expected " + std::to_string(func->argCnt) + " arguments, got " + std::to_string(argCnt));
+				
+				// Reuse the current frame, with the arguments in place of the locals
+				calls->closeUpvalues(base);
+				std::copy(base + callBase, base + callBase + argCnt, base);
+				ExecutionRecord& record = calls->back();
+				record.localCnt = argCnt;
+				record.func = func;
+				funcIdx = func->protoIdx;
+				enterFrame(argCnt);
+				NEXT_OP();
+			}
+			// Natives don't get a frame: just return their result
+			result = callNativeAt(funcValue, base + callBase, argCnt);
+			GC::step();
+			goto doReturn;
+		} TARGET(CALL_METHOD) {
+			uint16_t callBase = readUI16(it);
+			uint16_t nsConstantIdx = readUI16(it);
+			CFunction* impl = getMethod(chunk, nsConstantIdx, readUI16(it));
+			base[callBase] = impl->call(base + callBase, readUI16(it) + 1);
+			GC::step();
+			NEXT_OP();
+		} TARGET(CALL_METHOD_SLOT) {
+			uint16_t callBase = readUI16(it);
+			Value implValue = getGlobalSlot(readUI16(it));
+			it += 2; // method name, only kept for listings
+			CFunction* impl = implValue.get<CFunction>();
+			if(!impl) throw ExecutionError("Method implementation is not a CFunction");
+			base[callBase] = impl->call(base + callBase, readUI16(it) + 1);
+			GC::step();
+			NEXT_OP();
+		} TARGET(RETURN) {
+			result = rk(readUI16(it));
+			goto doReturn;
+		} TARGET(RETURN_NIL) {
+			result = Value::nil();
+			goto doReturn;
+		} TARGET(CLOSE) {
+			calls->closeUpvalues(base + readUI16(it));
+			NEXT_OP();
+		} TARGET(MAKE_FUNC) {
+			Value& dst = base[readUI16(it)];
+			uint16_t protoIdx = readUI16(it);
+			uint16_t argCnt = readUI16(it);
+			uint16_t upvalueCnt = readUI16(it);
+			Function* func = new Function(protoIdx, argCnt, upvalueCnt);
+			for(uint16_t i = 0; i < upvalueCnt; i++) {
+				int16_t idx = readI16(it);
+				if(idx >= 0)
+					func->upvalues[i] = calls->captureUpvalue(base + idx);
+				else
+					func->upvalues[i] = calls->back().func->upvalues[-idx-1];
+			}
+			dst = Value(func);
+			GC::step();
+			NEXT_OP();
+		} TARGET(MAKE_LIST) {
+			Value* values = base + readUI16(it);
+			uint16_t valueCnt = readUI16(it);
+			*values = Value(new List(std::vector<Value>(values, values + valueCnt)));
+			GC::step();
+			NEXT_OP();
+		} TARGET(MAKE_METHOD) {
+			Value& dst = base[readUI16(it)];
+			Value self = rk(readUI16(it));
+			uint16_t nsConstantIdx = readUI16(it);
+			CFunction* impl = getMethod(chunk, nsConstantIdx, readUI16(it));
+			dst = Value(new Method(self, impl));
+			GC::step();
+			NEXT_OP();
+		} TARGET(MAKE_METHOD_SLOT) {
+			Value& dst = base[readUI16(it)];
+			Value self = rk(readUI16(it));
+			Value implValue = getGlobalSlot(readUI16(it));
+			it += 2; // method name, only kept for listings
+			CFunction* impl = implValue.get<CFunction>();
+			if(!impl) throw ExecutionError("Method implementation is not a CFunction");
+			dst = Value(new Method(self, impl));
+			GC::step();
+			NEXT_OP();
+		} TARGET_DEFAULT {
+			throw ExecutionError("Opcode " + regOpcodeDesc((RegOpcode) *(it-1)) + " not yet implemented");
+		}
+	DISPATCH_LOOP_END
+	#undef BINARY_OP
+	#undef TYPED_OP
+
+doReturn:
+	calls->closeUpvalues(base);
+	calls->pop();
+	stack->top = base;
+	if(calls->size() > 0) {
+		*base = result; // the callee's base is the caller's result register
+		funcIdx = calls->back().funcIdx;
+		base = stack->begin() + calls->back().localBase;
+		stack->top = base + chunk.functions[funcIdx]->maxStack;
+		it = chunk.functions[funcIdx]->code.begin() + calls->back().codeOffset;
+		NEXT_OP();
+	}
+	// else, we just exited the main function
 }
 
+#undef PEEK_OP
+#undef FETCH_OP
+
 inline Value& VM::getLocal(uint16_t idx) {
-	if(idx >= calls.back()->localCnt)
-		throw ExecutionError("Trying to access undefined local");
-	return stack->array[calls.back()->localBase + idx];
+	return stack->array[calls->back().localBase + idx];
 }
 
 inline Upvalue& VM::getUpvalue(int16_t idx) {
-	if(idx >= 0) throw ExecutionError("Trying to access invalid upvalue");
-	Function* func = calls.back()->func;
-	if(!func) throw ExecutionError("Cannot access upvalues in main chunk");
-	return *func->upvalues[-idx-1];
+	return *calls->back().func->upvalues[-idx-1];
 }
 
 void VM::popLocals(uint16_t amount) {
-	ExecutionRecord& record = *calls.back();
-	for(uint16_t i = record.localCnt - amount; i < record.localCnt; i++) {
-		auto it = record.upvalueBackPointers.find(i);
-		if(it != record.upvalueBackPointers.end()) {
-			it->second->close();
-		}
-	}
-	calls.back()->localCnt -= amount;
-	stack->removeN(amount);
+	ExecutionRecord& record = calls->back();
+	calls->closeUpvalues(&stack->array[record.localBase + record.localCnt - amount]);
+	record.localCnt -= amount;
+	stack->top -= amount;
+}
+
+// Counts calls to a function prototype, compiling it once it gets hot.
+// Returns whether it should run compiled code.
+inline bool VM::useJit(Chunk& chunk, uint32_t funcIdx) {
+	if(!jitEnabled) return false;
+	if(!jitCode[funcIdx] && ++callCounts[funcIdx] == jitThreshold)
+		jitCode[funcIdx] = jit.compile(chunk, funcIdx, globalSlots->vec.data());
+	return jitCode[funcIdx] != nullptr;
+}
+
+// Slots are only ever written by link(), which keeps them in range
+inline Value VM::getGlobalSlot(uint16_t slot) {
+	return globalSlots->vec[slot];
 }
 
 std::string VM::getStringOperand(Chunk& chunk, uint16_t constantIdx) {
@@ -314,3 +1221,60 @@ Value& VM::getGlobal(Chunk& chunk, uint16_t nameConstantIdx) {
 	if(it == globals->map.end()) throw ExecutionError("Tring to access undefined global " + name);
 	return it->second;
 }
+
+CFunction* VM::getMethod(Chunk& chunk, uint16_t nsConstantIdx, uint16_t nameConstantIdx) {
+	Value nsValue = getGlobal(chunk, nsConstantIdx);
+	Namespace* ns = nsValue.get<Namespace>();
+	if(!ns) throw ExecutionError("Tring to get method from non-namespace " + nsValue.toString());
+	std::string prop = getStringOperand(chunk, nameConstantIdx);
+	auto it = ns->map.find(prop);
+	if(it == ns->map.end()) throw ExecutionError("Cannot find implementation for method '" + prop + "'");
+	CFunction* impl = it->second.get<CFunction>();
+	if(!impl) throw ExecutionError("Method implementation is not a CFunction");
+	return impl;
+}
+
+// If funcValue is a native function or method, calls it on the arguments on top of the stack
+bool VM::tryCallNative(Value funcValue, uint16_t argCnt) {
+	Method* method;
+	CFunction* cfunc;
+	if(method = funcValue.get<Method>()) {
+		// Slide the arguments up to insert the receiver below them
+		if(stack->size() < argCnt)
+			throw ExecutionError("Stack is too small to pop " + std::to_string(argCnt) + " values");
+		stack->push(Value::nil());
+		Value* args = stack->end() - argCnt - 1;
+		std::copy_backward(args, args + argCnt, args + argCnt + 1);
+		*args = method->self;
+		callNative(method->function, argCnt + 1);
+		return true;
+	} else if(cfunc = funcValue.get<CFunction>()) {
+		callNative(cfunc, argCnt);
+		return true;
+	}
+	return false;
+}
+
+// Calls a native function or method on arguments in the stack, the slot after
+// them being free: register code has the called value there
+Value VM::callNativeAt(Value funcValue, Value* args, uint16_t argCnt) {
+	Method* method;
+	CFunction* cfunc;
+	if(method = funcValue.get<Method>()) {
+		std::copy_backward(args, args + argCnt, args + argCnt + 1);
+		*args = method->self;
+		return method->function->call(args, argCnt + 1);
+	} else if(cfunc = funcValue.get<CFunction>()) {
+		return cfunc->call(args, argCnt);
+	}
+	throw ExecutionError("Cannot call " + funcValue.getTypeDesc());
+}
+
+// Calls a native function on the arguments on top of the stack, and replaces them with the result
+void VM::callNative(CFunction* impl, uint32_t argCnt) {
+	if(stack->size() < argCnt)
+		throw ExecutionError("Stack is too small to pop " + std::to_string(argCnt) + " values");
+	Value res = impl->call(stack->end() - argCnt, argCnt);
+	stack->removeN(argCnt);
+	stack->push(res);
+}
@@ -4,6 +4,8 @@
 #include "compiler/chunk.hpp"
 #include "value.hpp"
 #include "std.hpp"
+#include "jit.hpp"
+#include "decode.hpp"
 
 
 // For upvalues to work efficiently, the stack should not be reallocated, hence:
@@ -28,6 +30,8 @@ public:
 		if(top == base) throw ExecutionError("Stack is empty, cannot pop");
 		return *(--top);
 	}
+	inline void pushUnchecked(Value val) { *(top++) = val; }
+	inline Value popUnchecked() { return *(--top); }
 	inline uint32_t size() { return top - base; }
 	
 	void popN(std::vector<Value>& out, uint32_t n);
@@ -36,23 +40,83 @@ public:
 	void markChildren() override;
 };
 
+const uint32_t CALL_STACK_SIZE = 0x4000;
+
+struct ExecutionRecord {
+	uint32_t localBase;
+	uint32_t localCnt;
+	
+	uint32_t funcIdx;
+	uint32_t codeOffset;
+	
+	Function* func;
+	const void* jitResume; // set when the frame runs compiled code
+};
+
+// Frames are preallocated, so that calls don't allocate. The call stack also
+// keeps the functions being executed and the open upvalues alive.
+class CallStack : public Object {
+public:
+	std::array<ExecutionRecord, CALL_STACK_SIZE> frames;
+	ExecutionRecord* top;
+	Upvalue* openUpvalues; // sorted by decreasing stack position
+	
+	CallStack();
+	
+	inline ExecutionRecord& back() { return *(top - 1); }
+	inline void push(uint32_t localBase, uint32_t localCnt, Function* func) {
+		if(top == frames.data() + frames.size()) throw ExecutionError("Call stack overflow");
+		*(top++) = { localBase, localCnt, 0, 0, func, nullptr };
+	}
+	inline void pop() { top--; }
+	inline uint32_t size() { return top - frames.data(); }
+	
+	Upvalue* captureUpvalue(Value* local);
+	void closeUpvalues(Value* level);
+	
+	void markChildren() override;
+};
+
 class VM {
 public:
 	VM();
 	
+	void setJitEnabled(bool enabled);
+	void setJitThreshold(uint32_t calls);
+	// The chunk must be verified (see verifyChunk), it runs without checks
 	void run(Chunk& chunk);
 	
 private:
 	GC::Root<Namespace> globals;
+	GC::Root<List> globalSlots;
+	std::unordered_map<std::string, uint16_t> globalSlotIdx;
 	GC::Root<Stack> stack;
-	std::vector<std::unique_ptr<ExecutionRecord>> calls;
+	GC::Root<CallStack> calls;
+	
+	bool jitEnabled;
+	uint32_t jitThreshold;
+	Jit jit;
+	std::vector<JitCode> jitCode; // for each function prototype of the running chunk
+	std::vector<uint32_t> callCounts;
+	std::vector<DecodedFunction> decoded; // for each function prototype of the running chunk
 	
-	Value pop();
+	void assignGlobalSlots();
+	void link(Chunk& chunk);
+	void linkRegisters(Chunk& chunk);
+	int32_t findSlot(Chunk& chunk, uint16_t nameConstantIdx, int32_t methodConstantIdx = -1);
+	void execute(Chunk& chunk);
+	void executeRegisters(Chunk& chunk);
 	
 	Value& getLocal(uint16_t idx);
 	Upvalue& getUpvalue(int16_t idx);
 	void popLocals(uint16_t amount);
+	Value getGlobalSlot(uint16_t slot);
+	bool useJit(Chunk& chunk, uint32_t funcIdx);
 	
 	std::string getStringOperand(Chunk& chunk, uint16_t constantIdx);
 	Value& getGlobal(Chunk& chunk, uint16_t nameConstantIdx);
+	CFunction* getMethod(Chunk& chunk, uint16_t nsConstantIdx, uint16_t nameConstantIdx);
+	bool tryCallNative(Value funcValue, uint16_t argCnt);
+	void callNative(CFunction* impl, uint32_t argCnt);
+	Value callNativeAt(Value funcValue, Value* args, uint16_t argCnt);
 };
@@ -0,0 +1,55 @@
+# Checks the GC telemetry of the interpreter given as argument: the heap dump
+# of a known object graph, the keys of gcStats(), and the JSON written to
+# stderr by --gc-stats.
+
+import json
+import subprocess
+import sys
+
+somire = sys.argv[1]
+
+def run(name, source, options=[]):
+	path = "build/" + name + ".smr"
+	with open(path, "w") as f:
+		f.write(source)
+	result = subprocess.run([somire] + options + ["interpret", path], capture_output=True, text=True)
+	if result.returncode != 0:
+		sys.exit("FAIL: " + name + " exited with " + str(result.returncode) + "\n" + result.stdout + result.stderr)
+	return result
+
+def check(name, condition, message):
+	if not condition:
+		sys.exit("FAIL: " + name + ": " + message)
+
+def checkStats(name, stats):
+	for key in ["collections", "markPauses", "sweepPauses", "bytesAllocated", "heapBytes", "peakHeapBytes", "survivors"]:
+		check(name, key in stats, "no \"" + key + "\" key")
+	check(name, set(stats["collections"]) == {"minor", "full"}, "collections are not split in minor and full")
+	check(name, stats["markPauses"]["count"] == sum(stats["markPauses"]["histogram"].values()), "mark pauses missing from the histogram")
+	check(name, stats["peakHeapBytes"] >= stats["heapBytes"], "heap above its peak")
+	check(name, stats["survivors"].get("List", 0) > 0, "no surviving list")
+
+# A list holding two lists retains exactly its own slot and theirs, as
+# nothing else references them
+run("heap_dump", "let pair = [[1], [2.5, 3.5]]\ndumpHeap(\"build/heap.json\")\nlog(pair.size())\n")
+with open("build/heap.json") as f:
+	heap = json.load(f)
+objects = {obj["id"]: obj for obj in heap["objects"]}
+check("heap_dump", all(root in objects for root in heap["roots"]), "unknown root")
+pairs = [obj for obj in heap["objects"] if obj["type"] == "List" and len(obj["refs"]) == 2
+	and all(objects[ref]["type"] == "List" and objects[ref]["refs"] == [] for ref in obj["refs"])]
+check("heap_dump", len(pairs) == 1, "expected one list holding two lists, found " + str(len(pairs)))
+pair = pairs[0]
+inner = [objects[ref] for ref in pair["refs"]]
+check("heap_dump", all(obj["retained"] == obj["size"] for obj in inner), "a leaf list retains more than itself")
+check("heap_dump", pair["retained"] == pair["size"] + inner[0]["size"] + inner[1]["size"],
+	"the pair retains " + str(pair["retained"]) + " bytes")
+
+# gcStats() returns the same JSON as --gc-stats, while the program runs
+stats = run("gc_stats", "let xs = [[0]]\nlet i = 0\nwhile i < 50000:\n\txs = [[i]]\n\ti = i + 1\nwriteLine(gcStats())\n")
+checkStats("gc_stats", json.loads(stats.stdout))
+
+# --gc-stats writes its JSON to stderr, leaving stdout to the program
+stats = run("gc_stats_option", "log(1)\n", ["--gc-stats"])
+check("gc_stats_option", stats.stdout == "1\n", "unexpected output " + repr(stats.stdout))
+checkStats("gc_stats_option", json.loads(stats.stderr))